@@ -38,27 +38,57 @@
 
 /* References: Microchip MCP2515 data sheet, DS21801E, 2007.*/
 
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/dma-mapping.h>
+#include <linux/ethtool.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/net_tstamp.h>
 #include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
 #include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/platform/mcp251x.h>
 
+#define CREATE_TRACE_POINTS
+#include "mcp2515_trace.h"
+
 MODULE_DESCRIPTION("Driver for Microchip MCP2515 SPI CAN controller");
 MODULE_AUTHOR("Andre B. Oliveira <anbadeol@gmail.com>");
 MODULE_LICENSE("GPL");
 
+static unsigned stress_threads;
+module_param(stress_threads, uint, 0444);
+MODULE_PARM_DESC(stress_threads, "Threads raising simulated interrupts "
+         "and sending frames while the device is up, to stress the state "
+         "machine");
+
 /* Registers */
 #define CANCTRL     0x0f
+#define TEC         0x1c
+#define CANINTE     0x2b
+#define TXB0CTRL    0x30
 #define RXB0CTRL    0x60
 #define RXB1CTRL    0x70
 
+/* TXBnCTRL bits */
+#define TXBCTRL_TXP     0x03
+
 /* RXBnCTRL bits */
 #define RXBCTRL_RXM1    0x40
 #define RXBCTRL_RXM0    0x20
@@ -71,36 +101,389 @@ MODULE_LICENSE("GPL");
 /* RXBnDLC bits */
 #define RXBDLC_RTR  0x40
 
+/* CANCTRL bits */
+#define CANCTRL_REQOP_NORMAL    0x00
+#define CANCTRL_REQOP_LOOPBACK  0x40
+#define CANCTRL_REQOP_LISTEN    0x60
+#define CANCTRL_REQOP_CONF  0x80
+#define CANCTRL_REQOP_MASK  0xe0
+#define CANCTRL_OSM     0x08
+
+/* CANINTE bits */
+#define CANINTE_MERRE   0x80
+#define CANINTE_ERRIE   0x20
+
 /* CANINTF bits */
+#define CANINTF_MERRF   0x80
 #define CANINTF_ERRIF   0x20
+#define CANINTF_TX2IF   0x10
+#define CANINTF_TX1IF   0x08
 #define CANINTF_TX0IF   0x04
 #define CANINTF_RX1IF   0x02
 #define CANINTF_RX0IF   0x01
 
+/* READ STATUS instruction bits */
+#define STATUS_TX2IF    0x80
+#define STATUS_TX1IF    0x20
+#define STATUS_TX0IF    0x08
+#define STATUS_TX0REQ   0x04
+#define STATUS_RX1IF    0x02
+#define STATUS_RX0IF    0x01
+
 /* EFLG bits */
 #define EFLG_RX1OVR 0x80
 #define EFLG_RX0OVR 0x40
+#define EFLG_TXBO   0x20
+#define EFLG_TXEP   0x10
+#define EFLG_RXEP   0x08
+#define EFLG_TXWAR  0x04
+#define EFLG_RXWAR  0x02
+#define EFLG_EWARN  0x01
+
+/* Error interrupts beyond ERR_LIMIT in ERR_WINDOW_MS are an error storm:
+ * error interrupts are then disabled for ERR_WINDOW_MS.*/
+#define ERR_LIMIT   20
+#define ERR_WINDOW_MS   100
+
+/* Bits of priv->state, the state of the SPI state machine */
+#define STATE_BUSY  0x01    /* an async spi transaction is pending */
+#define STATE_INTERRUPT 0x02    /* interrupt handling is pending */
+#define STATE_TRANSMIT  0x04    /* transmission is pending */
+
+/* Default periods of the lost interrupt watchdog, and of the flags reads
+ * when polling because the device has no interrupt */
+#define WATCHDOG_MS 100
+#define POLL_US     1000
+
+/* Bits of the shortest frame, a data frame with a standard identifier and
+ * no data, with the interframe space: with the receive buffer rollover,
+ * a second frame can arrive in that time before the first is read */
+#define MIN_FRAME_BITS  47
+
+/* Bits of the longest frame, a data frame with an extended identifier and
+ * 8 data bytes, with worst case bit stuffing and the interframe space */
+#define MAX_FRAME_BITS  160
+
+/* Maximum number of stress threads */
+#define STRESS_THREADS  8
+
+/* Frames sent by a stress thread in each burst of simulated interrupts,
+ * and their identifier */
+#define STRESS_FRAMES   8
+#define STRESS_CAN_ID   0x7ff
+
+/* Classes of the SPI messages waiting for a bus shared by several devices,
+ * in the order they go: those that free a transmit buffer or read a
+ * receive buffer with both full, then the other receive buffer reads,
+ * then the rest */
+#define BUS_URGENT  0
+#define BUS_RX      1
+#define BUS_NORMAL  2
+
+/* Default priority of a device on a shared bus, 0 the highest, and the
+ * highest priority that can be set */
+#define BUS_PRIO    4
+#define BUS_PRIOS   8
+
+/* Default weight of a device on a shared bus, and the highest; a device
+ * gets a share of the bus time in proportion to its weight */
+#define BUS_WEIGHT  16
+#define BUS_WEIGHTS 256
+
+/* Cost of the setup of an SPI message, in bytes clocked */
+#define BUS_MSG_COST    4
+
+/* Bits of priv->update: register updates for the next message */
+#define UPDATE_INTE 0   /* error interrupt enable bits of CANINTE */
+#define UPDATE_CANCTRL  1   /* operation mode of CANCTRL */
+#define UPDATE_RTS  2   /* request to send the buffers in flight */
+
+/* Acceptance filters and masks, with identifiers laid out as in their
+ * registers: standard identifier in bits 28-18, extended in bits 17-0.*/
+#define HW_FILTERS  32      /* filters that userspace can set */
+#define HW_ID_MASK  0x1fffffff
+#define HW_SID_MASK 0x1ffc0000
+
+struct mcp2515_filter {
+    u32 id;
+    u32 mask;   /* unused for RXFn */
+    u8 ext;     /* set for extended frames */
+};
+
+/* Number of transmit buffers (TXB0, TXB1 and TXB2) */
+#define TXBS    3
+
+/* Transmission order keys: the controller sends the pending buffer with
+ * the highest TXBnCTRL.TXP first and, among equal TXP, the one with the
+ * highest buffer number, so key = TXP * TXBS + buffer number orders all
+ * the buffers in flight.*/
+#define TX_KEYS (4 * TXBS)
+
+/* Size of each of the transmit and receive halves of the SPI buffer */
+#define SPI_BUF_LEN 96
+
+/* Maximum number of transfers in one SPI message: the 5 of the prefix of
+ * mcp2515_message_init(), then at most 2 priority changes of the buffers in
+ * flight, a priority change, load, request to send and 3 for the flags
+ * read, in the message of mcp2515_load_txb() */
+#define XFERS   13
+
+/* Private flags, set with "ethtool --set-priv-flags" */
+#define PRIV_STATUS_READ    0x01    /* poll flags with READ STATUS */
+#define PRIV_SPEC_RX        0x02    /* read RXB0 along with status on irq */
+#define PRIV_RX_SPLIT       0x04    /* read only the data bytes received */
+#define PRIV_RX_SPLIT_AUTO  0x08    /* let the cost model choose the read */
+#define PRIV_NAPI           0x10    /* pass up received frames with NAPI */
+#define PRIV_LEVEL_IRQ      0x20    /* level triggered, masked when busy */
+#define PRIV_TX_QUEUES      0x40    /* a transmit queue for each buffer */
+
+/* Private flags that can only change while the device is down */
+#define PRIV_DOWN_ONLY      (PRIV_NAPI | PRIV_LEVEL_IRQ | PRIV_TX_QUEUES)
+
+/* Size of the ring of received frames waiting for NAPI, a power of 2 */
+#define RX_RING     16
+
+/* Size of the pool of preallocated receive skbs, a power of 2 */
+#define RX_POOL     16
+
+/* Reasons for the interrupt to be masked, bit numbers of irq_masked */
+#define MASK_NAPI   0   /* NAPI poll pending */
+#define MASK_LEVEL  1   /* level interrupt pending, until idle */
+
+/* Histogram buckets of SPI bytes clocked per received frame */
+#define RX_BYTES_BUCKETS    6
+
+/* SPI instructions, as counted in debugfs */
+#define INSTR_WRITE     0
+#define INSTR_READ      1
+#define INSTR_BIT_MODIFY    2
+#define INSTR_LOAD_TX       3
+#define INSTR_RTS       4
+#define INSTR_READ_RX       5
+#define INSTR_READ_STATUS   6
+#define INSTR_RX_STATUS     7
+#define INSTR_RESET     8
+#define INSTRS          9
+
+/* Buckets of the latency histograms: bucket n counts times of 2^n to
+ * 2^(n+1) - 1 ns, the last one longer times too */
+#define LAT_BUCKETS     32
+
+/* Driver statistics, reported by "ethtool -S" */
+struct mcp2515_stats {
+    u64 spi_messages;   /* asynchronous SPI messages submitted */
+    u64 spi_transfers;  /* transfers in those messages */
+    u64 spi_bytes;      /* bytes clocked by those transfers */
+    u64 tx_spi_messages;    /* messages with a frame to transmit held */
+    u64 tx_spi_messages_per_frame_x100; /* those per frame sent */
+    u64 status_reads;   /* flags polled with READ STATUS */
+    u64 flag_reads;     /* flags polled by reading CANINTF and EFLG */
+    u64 spec_rx_hits;   /* speculative RXB0 reads that got a frame */
+    u64 spec_rx_misses; /* speculative RXB0 reads that were discarded */
+    u64 rx_split_reads; /* receive buffers read header first */
+    u64 rx_spi_bytes[RX_BYTES_BUCKETS]; /* frames by SPI bytes to read */
+    u64 napi_polls;     /* NAPI polls that passed up frames */
+    u64 rx_ring_full;   /* frames dropped with the NAPI ring full */
+    u64 rx_pool_depth;  /* preallocated receive skbs available */
+    u64 rx_pool_misses; /* receive skbs allocated with the pool empty */
+    u64 rx_delay_ns;    /* total time from interrupt to passing up */
+    u64 rx_delay_max_ns;    /* longest of those times */
+    u64 err_storms;     /* times error interrupts were disabled */
+    u64 tx_hdr_bytes_saved; /* SPI bytes saved by buffer headers kept */
+    u64 tx_rebases;     /* priorities raised of frames in flight */
+    u64 interrupts;     /* interrupts handled */
+    u64 watchdog_recoveries;    /* watchdog flags reads finding work */
+    u64 coalesced_irqs; /* interrupts with a deferred flags read */
+    u64 rx_frames_per_irq_x100; /* received frames per interrupt */
+    u64 irq_restarts;   /* chain restarts for an interrupt while busy */
+    u64 stress_checks;  /* simulated interrupt bursts checked */
+    u64 stress_lost;    /* bursts with a wake-up lost */
+    u64 spi_errors;     /* SPI messages that failed to be submitted */
+    u64 tx_deferred;    /* frames queued while the chain was busy */
+    u64 bus_waits;      /* messages that waited for a shared bus */
+    u64 bus_wait_ns;    /* total time of those waits */
+    u64 bus_wait_max_ns;    /* longest of those waits */
+};
+
+/* An SPI bus shared by several devices: one message of theirs at a time
+ * is on the bus, the others wait in order of class, priority of their
+ * device, and virtual time, the bus time used by the device divided by
+ * its weight.*/
+struct mcp2515_bus {
+    struct list_head node;  /* in mcp2515_buses */
+    struct spi_master *master;
+    unsigned users;     /* devices on the bus */
+
+    spinlock_t lock;    /* Lock for the following: */
+    struct list_head wait;  /* devices with a message waiting */
+    u8 busy;        /* a message is on the bus */
+    u64 vtime;      /* virtual time of the last message started */
+};
+
+/* SPI accounting, shown in debugfs */
+struct mcp2515_debug {
+    u64 instr[INSTRS];  /* instructions in the messages submitted */
+    u64 instr_bytes[INSTRS];    /* bytes clocked by those instructions */
+    u64 stage_lat[STAGES][LAT_BUCKETS]; /* going on the bus to completion */
+    u64 rx_lat[LAT_BUCKETS];    /* interrupt to passing up a frame */
+    u64 bus_lat[LAT_BUCKETS];   /* waiting for a shared bus */
+    ktime_t submit_stamp;   /* time the current message went to the bus */
+    struct dentry *dir;
+};
 
 /* Network device private data */
 struct mcp2515_priv {
     struct can_priv can;    /* must be first for all CAN network devices */
     struct spi_device *spi; /* SPI device */
+    struct net_device *dev; /* network device */
 
     u8 canintf;     /* last read value of CANINTF register */
     u8 eflg;        /* last read value of EFLG register */
-
-    struct sk_buff *skb;    /* skb to transmit or currently transmitting */
-
-    spinlock_t lock;    /* Lock for the following flags: */
-    unsigned busy:1;    /* set when pending async spi transaction */
-    unsigned interrupt:1;   /* set when pending interrupt handling */
-    unsigned transmit:1;    /* set when pending transmission */
-
-    /* Message, transfer and buffers for one async spi transaction */
+    unsigned status_read:1; /* set when the flags are read with READ STATUS */
+    unsigned status_idle:1; /* and nothing to do in it may end the chain */
+    u8 clear_rxif;      /* RXnIF bits to clear in the next message */
+    u8 tec;         /* last read value of TEC register */
+    u8 rec;         /* last read value of REC register */
+    u8 *rx_ec;      /* where the flags read got TEC and REC */
+
+    /* Error storm limiter: err_timer enables error interrupts again. */
+    unsigned err_count;     /* error interrupts in this window */
+    unsigned long err_window;   /* jiffies at the start of the window */
+    struct hrtimer err_timer;
+
+    /* Lost interrupt watchdog, or polling of the flags without an
+     * interrupt, with periods set through sysfs (0 for none). */
+    struct hrtimer poll_timer;
+    unsigned watchdog_ms;
+    unsigned poll_us;
+    u8 polling;     /* no interrupt: poll_timer reads the flags */
+    u64 poll_ns;        /* its period: poll_us, or POLL_US if unset */
+    u8 wd_kick;     /* the watchdog started the chain */
+    u64 wd_reads;       /* flags reads at the last watchdog check */
+
+    /* Interrupt coalescing, set with "ethtool -C": the flags read for
+     * an interrupt, when idle with no transmission in flight, is
+     * deferred by coalesce_ns, as set by rx_usecs but no longer than
+     * the receive buffer rollover allows. */
+    struct hrtimer coalesce_timer;
+    u32 rx_usecs;
+    u32 rx_frames;
+    u64 coalesce_ns;
+
+    /* One-shot transmission: a transmit buffer whose request to send
+     * cleared without TXnIF was aborted; while some are in flight, the
+     * idle chain reads the flags again after a frame time, frame_ns,
+     * as an abort raises no interrupt. */
+    u8 *rx_status;      /* where the flags read got READ STATUS */
+    u8 tx_aborted;      /* bitmask of aborted transmit buffers */
+    struct hrtimer oneshot_timer;
+    u64 frame_ns;
+
+    /* Register updates made by the next message, from UPDATE_ bits. */
+    unsigned long update;
+    u8 inte;        /* error interrupt enable bits of CANINTE */
+    u8 canctrl;     /* operation mode of CANCTRL */
+
+    /* Bus-off: the controller is held in configuration mode, with the
+     * echo skbs of the buffers in flight put aside from the flush of
+     * can_restart(), until CAN_MODE_START, after which the controller
+     * goes through its bus-off recovery sequence. */
+    u8 restarting;      /* EFLG.TXBO is from before the restart */
+    struct sk_buff *tx_stash[TXBS];
+
+    unsigned rxb;       /* receive buffer being read */
+    unsigned rx_dlc_avg;    /* moving average of data length, times 16 */
+    u8 split_hdr[5];    /* header of a receive buffer read header first */
+    u8 split_rxb;       /* its receive buffer number */
+    u8 split_len;       /* data bytes left to read in the next message */
+    u8 *split_data;     /* where those bytes are in the current message */
+
+    /* Receive timestamps: a frame is stamped with the time of the
+     * interrupt it raised, or if there was none since the flags were
+     * last read, with the time the flags that show it were read. */
+    ktime_t irq_stamp;  /* time of the last interrupt */
+    ktime_t read_stamp; /* time the last flags read was submitted */
+    ktime_t look_stamp; /* time the previous flags read was submitted */
+    ktime_t rx_stamp[2];    /* timestamp of the frame in each buffer */
+    u8 rx_stamped;      /* bitmask of buffers with a timestamp */
+    ktime_t tx_stamp[TXBS]; /* time each transmit buffer completed */
+    u8 tx_stamped;      /* bitmask of buffers with a timestamp */
+    struct hwtstamp_config hwts;    /* set with SIOCSHWTSTAMP */
+
+    /* Received frames staged for NAPI: written by the chain at rx_head,
+     * passed up by the poll from rx_tail. */
+    struct napi_struct napi;
+    struct sk_buff *rx_ring[RX_RING];
+    unsigned rx_head;
+    unsigned rx_tail;
+    unsigned long irq_masked;   /* MASK_* bits */
+
+    /* Preallocated receive skbs: added by pool_work at pool_head, taken
+     * by the chain from pool_tail. */
+    struct work_struct pool_work;
+    struct sk_buff *pool[RX_POOL];
+    unsigned pool_head;
+    unsigned pool_tail;
+
+    u32 priv_flags;     /* PRIV_* flags */
+
+    /* Acceptance filters set through sysfs, and their merge into the
+     * masks RXM0 (RXB0) and RXM1 (RXB1) and the filters RXF0-1 (RXB0)
+     * and RXF2-5 (RXB1), written when the device opens.  No filters
+     * means receive any message. */
+    struct can_filter filter[HW_FILTERS];
+    unsigned filters;
+    u32 rxm[2];
+    struct mcp2515_filter rxf[6];
+
+    /* skbs waiting for a transmit buffer: of the single queue, or with
+     * PRIV_TX_QUEUES, of each queue, bound to the buffer and the TXP
+     * priority of its number. */
+    struct sk_buff *tx_skb[TXBS];
+
+    u8 tx_busy;     /* bitmask of transmit buffers in flight */
+    u8 tx_key[TXBS];    /* transmission order key of each buffer */
+    u8 tx_dlc[TXBS];    /* data length of the frame in each buffer */
+    u8 tx_len[TXBS];    /* its length on the bus, for BQL */
+    u8 tx_hdr[TXBS][5]; /* TXBnSIDH to TXBnDLC last written to each */
+    u8 tx_txp[TXBS];    /* TXBnCTRL.TXP last written to each */
+    u8 tx_hdr_valid;    /* bitmask of buffers with tx_hdr written */
+
+    /* STATE_ bits, changed with cmpxchg: whoever sets STATE_BUSY
+     * runs the chain, which takes the other bits before clearing it. */
+    atomic_t state;
+
+    struct task_struct *stress[STRESS_THREADS];
+
+    struct mcp2515_stats stats;
+    struct mcp2515_debug debug;
+
+    /* Shared SPI bus: the message of the chain waits in the bus list
+     * at bus_node while another device has the bus. */
+    struct mcp2515_bus *bus;
+    struct list_head bus_node;
+    u8 bus_owner;       /* the message on the bus is ours */
+    u8 bus_class;       /* BUS_ class of the message waiting */
+    u8 irq_read;        /* the message reads the flags for an interrupt */
+    u8 bus_prio;        /* priority of the device, set through sysfs */
+    u16 bus_weight;     /* weight of the device, set through sysfs */
+    u64 bus_vtime;      /* virtual time of the device */
+    ktime_t bus_queued; /* time the message started waiting */
+
+    /* Message, transfers and buffers for one async spi transaction.
+     * The bytes received for the transmit buffer at offset i of buf
+     * are at offset SPI_BUF_LEN + i.*/
     struct spi_message message;
-    struct spi_transfer transfer;
-    u8 rx_buf[14] __attribute__((aligned(8)));
-    u8 tx_buf[14] __attribute__((aligned(8)));
+    struct spi_transfer transfer[XFERS];
+    unsigned xfers;     /* number of transfers in message */
+    unsigned xfer_len;  /* bytes of buf used by those transfers */
+    unsigned msg_bytes; /* bytes clocked by those transfers */
+    u8 stage;       /* STAGE_ step of the chain of this message */
+    u8 *buf;        /* transmit half of the SPI buffer */
+    dma_addr_t dma;     /* DMA address of buf, if is_dma_mapped */
+    u8 *rx;         /* received bytes the completion looks at */
+    void (*complete)(void *context);    /* completion of this step */
+    u8 spi_buf[2 * SPI_BUF_LEN] __attribute__((aligned(8)));
 };
 
 static struct can_bittiming_const mcp2515_bittiming_const = {
@@ -117,11 +500,12 @@ static struct can_bittiming_const mcp2515_bittiming_const = {
 
 /* SPI asynchronous completion callback functions.*/
 static void mcp2515_read_flags_complete(void *context);
-static void mcp2515_read_rxb0_complete(void *context);
-static void mcp2515_read_rxb1_complete(void *context);
+static void mcp2515_complete(void *context);
+static void mcp2515_read_rxb_complete(void *context);
+static void mcp2515_read_rxb_head_complete(void *context);
+static void mcp2515_read_spec_complete(void *context);
 static void mcp2515_clear_canintf_complete(void *context);
 static void mcp2515_clear_eflg_complete(void *context);
-static void mcp2515_rts_txb0(void *context);
 static void mcp2515_read_flags(struct net_device *dev);
 
 /* Write VALUE to register at address ADDR.
@@ -146,6 +530,191 @@ static int mcp2515_reset(struct spi_device *spi)
     return spi_write(spi, &reset, sizeof(reset));
 }
 
+/* Set the 4 identifier registers at BUF, from SIDH to EID0.*/
+static void mcp2515_encode_id(u8 *buf, u32 id, int ext)
+{
+    buf[0] = id >> 21;
+    buf[1] = (id >> 13 & 0xe0) | (ext ? 8 : 0) | (id >> 16 & 3);
+    buf[2] = id >> 8;
+    buf[3] = id;
+}
+
+/* Return the mask that a group of filters can use in hardware: MASK, the
+ * identifier bits all the filters compare, limited to the standard
+ * identifier bits if STD, that is if one of them is for standard frames,
+ * whose extended identifier bits would be compared with the first two data
+ * bytes.*/
+static u32 mcp2515_group_mask(u32 mask, int std)
+{
+    return std ? mask & HW_SID_MASK : mask;
+}
+
+/* Merge the filters set by userspace into the hardware masks and filters.
+ * Filters accepting the most alike identifiers are merged until six are
+ * left, then they are split between RXB0 (two filters) and RXB1 (four)
+ * so that the masks compare as many identifier bits as possible.  Every
+ * merge only widens what is accepted: the CAN core still filters.*/
+static void mcp2515_fit_filters(struct mcp2515_priv *priv)
+{
+    struct mcp2515_filter f[HW_FILTERS], *g;
+    unsigned n = priv->filters;
+    unsigned i, j, bi = 0, bj = 0, sel, best_sel = 0;
+    int weight, best, grp;
+    u32 m[2], best_m[2] = { 0, 0 };
+    int std[2];
+
+    for (i = 0; i < n; i++) {
+        canid_t id = priv->filter[i].can_id;
+        canid_t mask = priv->filter[i].can_mask;
+
+        f[i].ext = !!(id & CAN_EFF_FLAG);
+        if (f[i].ext) {
+            f[i].mask = mask & HW_ID_MASK;
+        } else {
+            id = (id & CAN_SFF_MASK) << 18;
+            f[i].mask = (mask & CAN_SFF_MASK) << 18;
+        }
+        f[i].id = id & f[i].mask;
+    }
+
+    while (n > 6) {
+        best = -1;
+        for (i = 0; i < n; i++)
+            for (j = i + 1; j < n; j++) {
+                if (f[i].ext != f[j].ext)
+                    continue;
+                weight = hweight32(f[i].mask & f[j].mask &
+                           ~(f[i].id ^ f[j].id));
+                if (weight > best) {
+                    best = weight;
+                    bi = i;
+                    bj = j;
+                }
+            }
+        f[bi].mask &= f[bj].mask & ~(f[bi].id ^ f[bj].id);
+        f[bi].id &= f[bi].mask;
+        f[bj] = f[--n];
+    }
+
+    /* Bit i of sel set puts filter i in RXB0. */
+    best = -1;
+    for (sel = 0; sel < 1 << n; sel++) {
+        if (hweight32(sel) > 2 || n - hweight32(sel) > 4)
+            continue;
+        m[0] = m[1] = HW_ID_MASK;
+        std[0] = std[1] = 0;
+        for (i = 0; i < n; i++) {
+            grp = !(sel & 1 << i);
+            m[grp] &= f[i].mask;
+            std[grp] |= !f[i].ext;
+        }
+        m[0] = mcp2515_group_mask(m[0], std[0]);
+        m[1] = mcp2515_group_mask(m[1], std[1]);
+        weight = 0;
+        for (i = 0; i < n; i++)
+            weight += hweight32(m[!(sel & 1 << i)]);
+        if (weight > best) {
+            best = weight;
+            best_sel = sel;
+            best_m[0] = m[0];
+            best_m[1] = m[1];
+        }
+    }
+
+    /* Fill the filters of each buffer, repeating the first one of the
+     * buffer, or if it has none, an exact copy of the first one of the
+     * other buffer. */
+    for (grp = 0; grp < 2; grp++) {
+        unsigned first = grp ? 2 : 0, last = grp ? 6 : 2, k = first;
+
+        for (i = 0; i < n; i++) {
+            if (!(best_sel & 1 << i) != grp)
+                continue;
+            priv->rxf[k].id = f[i].id & best_m[grp];
+            priv->rxf[k].ext = f[i].ext;
+            k++;
+        }
+        if (k == first) {
+            /* All the filters went to the other buffer. */
+            best_m[grp] = mcp2515_group_mask(HW_ID_MASK, !f[0].ext);
+            priv->rxf[k].id = f[0].id & best_m[!grp];
+            priv->rxf[k].ext = f[0].ext;
+            k++;
+        }
+        for (g = &priv->rxf[k]; k < last; k++, g++)
+            *g = priv->rxf[first];
+        priv->rxm[grp] = best_m[grp];
+    }
+}
+
+/* Write the acceptance filters and masks, or let the receive buffers
+ * take any message if no filters are set.
+ * Synchronous.*/
+static int mcp2515_config_filters(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct spi_device *spi = priv->spi;
+    u8 buf[14] __attribute__((aligned(8)));
+    unsigned i;
+    int err;
+
+    if (!priv->filters) {
+        err = mcp2515_write(spi, RXB0CTRL,
+                    RXBCTRL_RXM1 | RXBCTRL_RXM0 | RXBCTRL_BUKT);
+        if (err)
+            return err;
+
+        return mcp2515_write(spi, RXB1CTRL,
+                     RXBCTRL_RXM1 | RXBCTRL_RXM0);
+    }
+
+    /* RXF0-2 at 0x00, RXF3-5 at 0x10 */
+    for (i = 0; i < 6; i++) {
+        if (i % 3 == 0) {
+            buf[0] = 2; /* write instruction */
+            buf[1] = i / 3 * 0x10;  /* address of RXFnSIDH */
+        }
+        mcp2515_encode_id(buf + 2 + i % 3 * 4, priv->rxf[i].id,
+                  priv->rxf[i].ext);
+        if (i % 3 == 2) {
+            err = spi_write(spi, buf, 14);
+            if (err)
+                return err;
+        }
+    }
+
+    buf[0] = 2; /* write instruction */
+    buf[1] = 0x20;  /* address of RXM0SIDH */
+    mcp2515_encode_id(buf + 2, priv->rxm[0], 0);
+    mcp2515_encode_id(buf + 6, priv->rxm[1], 0);
+    err = spi_write(spi, buf, 10);
+    if (err)
+        return err;
+
+    err = mcp2515_write(spi, RXB0CTRL, RXBCTRL_BUKT);
+    if (err)
+        return err;
+
+    return mcp2515_write(spi, RXB1CTRL, 0);
+}
+
+/* Return the operation mode bits of CANCTRL for the control modes.*/
+static u8 mcp2515_canctrl(struct mcp2515_priv *priv)
+{
+    u32 ctrlmode = priv->can.ctrlmode;
+    u8 canctrl = CANCTRL_REQOP_NORMAL;
+
+    if (ctrlmode & CAN_CTRLMODE_LOOPBACK)
+        canctrl = CANCTRL_REQOP_LOOPBACK;
+    else if (ctrlmode & CAN_CTRLMODE_LISTENONLY)
+        canctrl = CANCTRL_REQOP_LISTEN;
+
+    if (ctrlmode & CAN_CTRLMODE_ONE_SHOT)
+        canctrl |= CANCTRL_OSM;
+
+    return canctrl;
+}
+
 /* Set the bit timing configuration registers, the interrupt enable register
  * and the receive buffers control registers.
  * Synchronous.*/
@@ -177,17 +746,12 @@ static int mcp2515_config(struct net_device *dev)
     if (err)
         return err;
 
-    err = mcp2515_write(spi, RXB0CTRL,
-                RXBCTRL_RXM1 | RXBCTRL_RXM0 | RXBCTRL_BUKT);
-    if (err)
-        return err;
-
-    err = mcp2515_write(spi, RXB1CTRL, RXBCTRL_RXM1 | RXBCTRL_RXM0);
+    err = mcp2515_config_filters(dev);
     if (err)
         return err;
 
-    /* Finally, enter normal operation mode. */
-    err = mcp2515_write(spi, CANCTRL, 0);
+    /* Finally, enter normal, or loopback or listen-only, operation mode. */
+    err = mcp2515_write(spi, CANCTRL, mcp2515_canctrl(priv));
     if (err)
         return err;
 
@@ -199,442 +763,2718 @@ static int mcp2515_config(struct net_device *dev)
 
 /************************************************************************/
 
-/* Start an asynchronous SPI transaction.*/
-#define mcp2515_spi_async() {\
-    int err = spi_async(priv->spi, &priv->message);\
-    if (err)\
-        netdev_err(dev, "%s failed with err=%d\n", __func__, err);\
-}\
-
-/* Read CANINTF and EFLG registers in one shot.
- * Asynchronous.*/
-static void mcp2515_read_flags(struct net_device *dev)
+/* Append a transfer of LEN bytes to the SPI message, deasserting chip
+ * select between it and the previous one, and return its transmit buffer.*/
+static u8 *mcp2515_transfer(struct mcp2515_priv *priv, unsigned len)
 {
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    struct spi_transfer *t = &priv->transfer[priv->xfers];
+    unsigned offset = priv->xfer_len;
 
-    buf[0] = 3; /* read instruction */
-    buf[1] = 0x2c;  /* address of CANINTF */
-    buf[2] = 0; /* CANINTF */
-    buf[3] = 0; /* EFLG */
-    priv->transfer.len = 4;
-    priv->message.complete = mcp2515_read_flags_complete;
+    BUG_ON(priv->xfers == XFERS || offset + len > SPI_BUF_LEN);
 
-    mcp2515_spi_async();
-}
+    if (priv->xfers)
+        t[-1].cs_change = 1;
 
-/* Read receive buffer 0
- * Asynchronous.*/
-static void mcp2515_read_rxb0(struct net_device *dev)
-{
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    memset(t, 0, sizeof(*t));
+    t->tx_buf = priv->buf + offset;
+    t->rx_buf = priv->buf + SPI_BUF_LEN + offset;
+    t->tx_dma = priv->dma + offset;
+    t->rx_dma = priv->dma + SPI_BUF_LEN + offset;
+    t->len = len;
+    spi_message_add_tail(t, &priv->message);
 
-    memset(buf, 0, 14);
-    buf[0] = 0x90;
-    priv->transfer.len = 14; /* instruction + id(4) + dlc + data(8) */
-    priv->message.complete = mcp2515_read_rxb0_complete;
+    priv->xfers++;
+    priv->xfer_len = ALIGN(offset + len, 4);
+    priv->msg_bytes += len;
+    priv->stats.spi_bytes += len;
 
-    mcp2515_spi_async();
+    return priv->buf + offset;
 }
 
-/* Read receive buffer 1
- * Asynchronous.*/
-static void mcp2515_read_rxb1(struct net_device *dev)
+/* Start building a new SPI message for the next step of the chain, first
+ * clearing the RXnIF flags of buffers read without READ RX BUFFER.*/
+static void mcp2515_message_init(struct net_device *dev)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    int is_dma_mapped = priv->message.is_dma_mapped;
+    u8 *buf;
 
-    memset(buf, 0, 14);
-    buf[0] = 0x94;
-    priv->transfer.len = 14; /* instruction + id(4) + dlc + data(8) */
-    priv->message.complete = mcp2515_read_rxb1_complete;
+    spi_message_init(&priv->message);
+    priv->message.complete = mcp2515_complete;
+    priv->message.context = dev;
+    priv->message.is_dma_mapped = is_dma_mapped;
+    priv->xfers = 0;
+    priv->xfer_len = 0;
+    priv->msg_bytes = 0;
+
+    if (priv->clear_rxif) {
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 5; /* bit modify instruction */
+        buf[1] = 0x2c;  /* address of CANINTF */
+        buf[2] = priv->clear_rxif;  /* mask */
+        buf[3] = 0; /* data */
+        priv->clear_rxif = 0;
+    }
 
-    mcp2515_spi_async();
-}
+    if (test_and_clear_bit(UPDATE_INTE, &priv->update)) {
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 5; /* bit modify instruction */
+        buf[1] = CANINTE;   /* address of CANINTE */
+        buf[2] = CANINTE_MERRE | CANINTE_ERRIE; /* mask */
+        buf[3] = priv->inte;    /* data */
+    }
 
-/* Clear CANINTF bits.
- * Asynchronous.*/
-static void mcp2515_clear_canintf(struct net_device *dev)
-{
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    if (test_and_clear_bit(UPDATE_CANCTRL, &priv->update)) {
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 5; /* bit modify instruction */
+        buf[1] = CANCTRL;   /* address of CANCTRL */
+        buf[2] = CANCTRL_REQOP_MASK;    /* mask */
+        buf[3] = priv->canctrl; /* data */
+    }
 
-    buf[0] = 5; /* bit modify instruction */
-    buf[1] = 0x2c;  /* address of CANINTF */
-    buf[2] = priv->canintf & ~(CANINTF_RX0IF | CANINTF_RX1IF); /* mask */
-    buf[3] = 0; /* data */
-    priv->transfer.len = 4;
-    priv->message.complete = mcp2515_clear_canintf_complete;
+    if (test_and_clear_bit(UPDATE_RTS, &priv->update) && priv->tx_busy) {
+        buf = mcp2515_transfer(priv, 1);
+        buf[0] = 0x80 | priv->tx_busy;  /* request to send */
+    }
 
-    mcp2515_spi_async();
+    /* The data of a receive buffer read header first; the READ RX
+     * BUFFER instruction clears its RXnIF. */
+    if (priv->split_len) {
+        buf = mcp2515_transfer(priv, 1 + priv->split_len);
+        memset(buf, 0, 1 + priv->split_len);
+        buf[0] = 0x92 | priv->split_rxb << 2;   /* read rx buffer at RXBnD0 */
+        priv->split_data = buf + SPI_BUF_LEN + 1;
+        priv->split_len = 0;
+    }
 }
 
-/* Clear EFLG bits.
- * Asynchronous.*/
-static void mcp2515_clear_eflg(struct net_device *dev)
+/* Return the INSTR_ number of the instruction byte OP.*/
+static unsigned mcp2515_instr(u8 op)
 {
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
-
-    buf[0] = 5;     /* bit modify instruction */
-    buf[1] = 0x2d;      /* address of EFLG */
-    buf[2] = priv->eflg;    /* mask */
-    buf[3] = 0;     /* data */
-    priv->transfer.len = 4;
-    priv->message.complete = mcp2515_clear_eflg_complete;
-
-    mcp2515_spi_async();
+    switch (op & 0xf0) {
+    case 0x00:
+        return op == 2 ? INSTR_WRITE : op == 3 ? INSTR_READ :
+            INSTR_BIT_MODIFY;
+    case 0x40:
+        return INSTR_LOAD_TX;
+    case 0x80:
+        return INSTR_RTS;
+    case 0x90:
+        return INSTR_READ_RX;
+    case 0xa0:
+        return INSTR_READ_STATUS;
+    case 0xb0:
+        return INSTR_RX_STATUS;
+    default:
+        return INSTR_RESET;
+    }
 }
 
-/* Send the "load transmit buffer 0" SPI message.
- * Asynchronous.*/
-static void mcp2515_load_txb0(struct sk_buff *skb, struct net_device *dev)
+/* Count the instructions of the SPI message about to be submitted, each
+ * the first byte of a transfer.*/
+static void mcp2515_account(struct mcp2515_priv *priv)
 {
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    struct can_frame *frame = (struct can_frame *)skb->data;
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    struct spi_transfer *t;
+    unsigned i, n;
+
+    for (i = 0; i < priv->xfers; i++) {
+        t = &priv->transfer[i];
+        n = mcp2515_instr(*(const u8 *)t->tx_buf);
+        priv->debug.instr[n]++;
+        priv->debug.instr_bytes[n] += t->len;
+    }
+}
 
-    buf[0] = 0x40;  /* load txb0 instruction */
+/* Count the SPI message about to be submitted in tx_spi_messages if a
+ * frame to transmit is held, from ndo_start_xmit() to the clearing of its
+ * TXnIF: the messages that each frame costs, with the flags reads and
+ * clearing shared by the frames in flight.*/
+static void mcp2515_account_tx(struct mcp2515_priv *priv)
+{
+    unsigned i;
 
-/* Set the transmit buffer, starting at TXB0SIDH, for an skb.*/
-    if (frame->can_id & CAN_EFF_FLAG) {
-        buf[1] = frame->can_id >> 21;
-        buf[2] = (frame->can_id >> 13 & 0xe0) | 8 |
-            (frame->can_id >> 16 & 3);
-        buf[3] = frame->can_id >> 8;
-        buf[4] = frame->can_id;
-    } else {
-        buf[1] = frame->can_id >> 3;
-        buf[2] = frame->can_id << 5;
-        buf[3] = 0;
-        buf[4] = 0;
+    for (i = 0; i < TXBS; i++) {
+        if (priv->tx_busy & 1 << i || ACCESS_ONCE(priv->tx_skb[i])) {
+            priv->stats.tx_spi_messages++;
+            return;
+        }
     }
+}
 
-    if (frame->can_id & CAN_RTR_FLAG)
-        buf[5] = frame->can_dlc | 0x40;
-    else
-        buf[5] = frame->can_dlc;
+/* Count a latency of NS nanoseconds in the histogram HIST.*/
+static void mcp2515_lat(u64 *hist, s64 ns)
+{
+    unsigned n = ns > 0 ? fls64(ns) - 1 : 0;
 
-    memcpy(buf + 6, frame->data, frame->can_dlc);
+    hist[min(n, LAT_BUCKETS - 1u)]++;
+}
 
-    priv->transfer.len = 6 + frame->can_dlc;
-    priv->message.complete = mcp2515_rts_txb0;
+/* Return the BUS_ class of the message of the chain.*/
+static unsigned mcp2515_bus_class(struct mcp2515_priv *priv)
+{
+    switch (priv->stage) {
+    case STAGE_READ_RXB:
+    case STAGE_READ_RXB_HEAD:
+        /* With both receive buffers full, the next frame overflows. */
+        if ((priv->canintf & (CANINTF_RX0IF | CANINTF_RX1IF)) ==
+            (CANINTF_RX0IF | CANINTF_RX1IF))
+            return BUS_URGENT;
+        return BUS_RX;
+    case STAGE_CLEAR_CANINTF:
+        if (priv->canintf &
+            (CANINTF_TX0IF | CANINTF_TX1IF | CANINTF_TX2IF))
+            return BUS_URGENT;
+        return BUS_NORMAL;
+    case STAGE_READ_SPEC:
+    case STAGE_CLEAR_EFLG:
+        return BUS_RX;
+    case STAGE_READ_FLAGS:
+        /* An interrupt usually means a frame waits. */
+        return priv->irq_read ? BUS_RX : BUS_NORMAL;
+    default:
+        return BUS_NORMAL;
+    }
+}
 
-    mcp2515_spi_async();
+/* Give the bus to the message of PRIV, advancing its virtual time by the
+ * bus time of the message over its weight.  Called with the bus lock.*/
+static void mcp2515_bus_start(struct mcp2515_bus *bus,
+                  struct mcp2515_priv *priv)
+{
+    bus->busy = 1;
+    bus->vtime = priv->bus_vtime;
+    priv->bus_vtime += div_u64((u64)(priv->msg_bytes + BUS_MSG_COST) *
+                   BUS_WEIGHTS, priv->bus_weight);
+    priv->bus_owner = 1;
 }
 
-/* Send the "request to send transmit buffer 0" SPI message.
- * Asynchronous.*/
-static void mcp2515_rts_txb0(void *context)
+/* Take the message that goes next off the waiting list of the bus, or
+ * return NULL if none waits.  Called with the bus lock.*/
+static struct mcp2515_priv *mcp2515_bus_pick(struct mcp2515_bus *bus)
 {
-    struct net_device *dev = context;
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = (u8 *)priv->transfer.tx_buf;
+    struct mcp2515_priv *priv, *best = NULL;
+
+    list_for_each_entry(priv, &bus->wait, bus_node) {
+        if (best && (priv->bus_class > best->bus_class ||
+                 (priv->bus_class == best->bus_class &&
+                  (priv->bus_prio > best->bus_prio ||
+                   (priv->bus_prio == best->bus_prio &&
+                    priv->bus_vtime >= best->bus_vtime)))))
+            continue;
+        best = priv;
+    }
 
-    buf[0] = 0x81;  /* request to send txb0 instruction */
-    priv->transfer.len = 1;
-    priv->message.complete = (void *)mcp2515_read_flags;
+    if (best)
+        list_del_init(&best->bus_node);
 
-    mcp2515_spi_async();
+    return best;
 }
 
-/************************************************************************/
-
-/* Called when the "read CANINTF and EFLG registers" SPI message completes.*/
-static void mcp2515_read_flags_complete(void *context)
+/* Release the bus after the message of PRIV, if it had it, and start the
+ * message that goes next.*/
+static void mcp2515_bus_done(struct mcp2515_priv *priv)
 {
-    struct net_device *dev = context;
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    u8 *buf = priv->transfer.rx_buf;
-    unsigned canintf;
+    struct mcp2515_bus *bus = priv->bus;
+    struct mcp2515_priv *next;
     unsigned long flags;
+    s64 wait;
+    int err;
 
-    priv->canintf = canintf = buf[2];
-    priv->eflg = buf[3];
-
-    if (canintf & CANINTF_RX0IF)
-        mcp2515_read_rxb0(dev);
-    else if (canintf & CANINTF_RX1IF)
-        mcp2515_read_rxb1(dev);
-    else if (canintf)
-        mcp2515_clear_canintf(dev);
-    else {
-        spin_lock_irqsave(&priv->lock, flags);
-        if (priv->transmit) {
-            priv->transmit = 0;
-            spin_unlock_irqrestore(&priv->lock, flags);
-            mcp2515_load_txb0(priv->skb, dev);
-        } else if (priv->interrupt) {
-            priv->interrupt = 0;
-            spin_unlock_irqrestore(&priv->lock, flags);
-            mcp2515_read_flags(dev);
-        } else {
-            priv->busy = 0;
-            spin_unlock_irqrestore(&priv->lock, flags);
+    if (!priv->bus_owner)
+        return;
+    priv->bus_owner = 0;
+
+    for (;;) {
+        spin_lock_irqsave(&bus->lock, flags);
+        next = mcp2515_bus_pick(bus);
+        if (!next) {
+            bus->busy = 0;
+            spin_unlock_irqrestore(&bus->lock, flags);
+            return;
         }
+        mcp2515_bus_start(bus, next);
+        spin_unlock_irqrestore(&bus->lock, flags);
+
+        wait = ktime_to_ns(ktime_sub(ktime_get(), next->bus_queued));
+        next->stats.bus_waits++;
+        next->stats.bus_wait_ns += wait;
+        if (wait > next->stats.bus_wait_max_ns)
+            next->stats.bus_wait_max_ns = wait;
+        mcp2515_lat(next->debug.bus_lat, wait);
+
+        next->debug.submit_stamp = ktime_get();
+        err = spi_async(next->spi, &next->message);
+        if (!err)
+            return;
+        next->bus_owner = 0;
+        next->stats.spi_errors++;
+        netdev_err(next->dev, "%s failed with err=%d\n", __func__, err);
     }
 }
 
-/* Called when one of the "read receive buffer i" SPI message completes.*/
-static void mcp2515_read_rxb_complete(void *context)
+/* Submit the SPI message of the chain: right away unless other devices
+ * share the bus, else when the bus goes to it.*/
+static int mcp2515_bus_submit(struct mcp2515_priv *priv)
 {
-    struct net_device *dev = context;
-    struct mcp2515_priv *priv = netdev_priv(dev);
-    struct sk_buff *skb;
-    struct can_frame *frame;
-    u8 *buf = priv->transfer.rx_buf;
+    struct mcp2515_bus *bus = priv->bus;
+    unsigned long flags;
+    int err;
 
-    skb = alloc_can_skb(dev, &frame);
-    if (!skb) {
-        dev->stats.rx_dropped++;
-        return;
+    if (!bus || bus->users < 2) {
+        priv->debug.submit_stamp = ktime_get();
+        return spi_async(priv->spi, &priv->message);
     }
 
-    if (buf[2] & RXBSIDL_IDE) {
-        frame->can_id = buf[1] << 21 | (buf[2] & 0xe0) << 13 |
-            (buf[2] & 3) << 16 | buf[3] << 8 | buf[4] |
-             CAN_EFF_FLAG;
-        if (buf[5] & RXBDLC_RTR)
-            frame->can_id |= CAN_RTR_FLAG;
-    } else {
-        frame->can_id = buf[1] << 3 | buf[2] >> 5;
-        if (buf[2] & RXBSIDL_SRR)
-            frame->can_id |= CAN_RTR_FLAG;
+    spin_lock_irqsave(&bus->lock, flags);
+    if (bus->busy) {
+        priv->bus_class = mcp2515_bus_class(priv);
+        /* No credit for the time the device left the bus alone. */
+        if (priv->bus_vtime < bus->vtime)
+            priv->bus_vtime = bus->vtime;
+        priv->bus_queued = ktime_get();
+        list_add_tail(&priv->bus_node, &bus->wait);
+        spin_unlock_irqrestore(&bus->lock, flags);
+        return 0;
     }
+    if (priv->bus_vtime < bus->vtime)
+        priv->bus_vtime = bus->vtime;
+    mcp2515_bus_start(bus, priv);
+    spin_unlock_irqrestore(&bus->lock, flags);
 
-    frame->can_dlc = get_can_dlc(buf[5] & 0xf);
+    priv->debug.submit_stamp = ktime_get();
+    err = spi_async(priv->spi, &priv->message);
+    if (err)
+        mcp2515_bus_done(priv);
 
-    memcpy(frame->data, buf + 6, frame->can_dlc);
+    return err;
+}
 
-    dev->stats.rx_packets++;
-    dev->stats.rx_bytes += frame->can_dlc;
+/* Start an asynchronous SPI transaction, for step STEP of the chain.*/
+#define mcp2515_spi_async(step) {\
+    int err;\
+    priv->stage = step;\
+    trace_mcp2515_submit(dev, atomic_read(&priv->state), step,\
+                 priv->canintf, priv->eflg, priv->msg_bytes);\
+    priv->stats.spi_messages++;\
+    priv->stats.spi_transfers += priv->xfers;\
+    mcp2515_account(priv);\
+    mcp2515_account_tx(priv);\
+    err = mcp2515_bus_submit(priv);\
+    if (err) {\
+        priv->stats.spi_errors++;\
+        netdev_err(dev, "%s failed with err=%d\n", __func__, err);\
+    }\
+}\
+
+/* Append the reading of the interrupt flags.  Unless FULL, and if enabled
+ * with a level interrupt, the 2-byte READ STATUS instruction gets the
+ * receive and transmit flags, else TEC and REC, then CANINTF and EFLG
+ * registers are read, after the status for its request to send bits in
+ * one-shot mode.
+ * READ STATUS has no error or wake-up flags, but those keep the level
+ * interrupt asserted: a status with nothing to do ends the chain, and the
+ * interrupt, raised again if still asserted when unmasked, gets the full
+ * read after its own status read.*/
+static void mcp2515_add_read_flags(struct mcp2515_priv *priv, int full)
+{
+    u8 *buf;
+
+    if (!full && priv->priv_flags & PRIV_STATUS_READ &&
+        priv->priv_flags & PRIV_LEVEL_IRQ && !priv->polling) {
+        buf = mcp2515_transfer(priv, 2);
+        buf[0] = 0xa0;  /* read status instruction */
+        buf[1] = 0; /* status */
+        priv->status_read = 1;
+        priv->status_idle = !priv->irq_read;
+        priv->stats.status_reads++;
+    } else {
+        priv->rx_status = NULL;
+        if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT) {
+            buf = mcp2515_transfer(priv, 2);
+            buf[0] = 0xa0;  /* read status instruction */
+            buf[1] = 0; /* status */
+            priv->rx_status = buf + SPI_BUF_LEN;
+        }
 
-    netif_rx(skb);
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 3; /* read instruction */
+        buf[1] = TEC;   /* address of TEC */
+        buf[2] = 0; /* TEC */
+        buf[3] = 0; /* REC */
+        priv->rx_ec = buf + SPI_BUF_LEN;
+
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 3; /* read instruction */
+        buf[1] = 0x2c;  /* address of CANINTF */
+        buf[2] = 0; /* CANINTF */
+        buf[3] = 0; /* EFLG */
+        priv->status_read = 0;
+        priv->stats.flag_reads++;
+    }
+    priv->rx = buf + SPI_BUF_LEN;
+    priv->read_stamp = ktime_get_real();
 }
 
-/* Transmit a frame if transmission pending, else read and process flags.*/
-static void mcp2515_transmit_or_read_flags(struct net_device *dev)
+/* Read the interrupt flags, in full if FULL.
+ * Asynchronous.*/
+static void __mcp2515_read_flags(struct net_device *dev, int full)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    unsigned long flags;
 
-    spin_lock_irqsave(&priv->lock, flags);
-    if (priv->transmit) {
-        priv->transmit = 0;
-        spin_unlock_irqrestore(&priv->lock, flags);
-        mcp2515_load_txb0(priv->skb, dev);
-    } else {
-        spin_unlock_irqrestore(&priv->lock, flags);
-        mcp2515_read_flags(dev);
-    }
+    mcp2515_message_init(dev);
+    mcp2515_add_read_flags(priv, full);
+    priv->complete = mcp2515_read_flags_complete;
+
+    mcp2515_spi_async(STAGE_READ_FLAGS);
 }
 
-/* Called when the "read receive buffer 0" SPI message completes.*/
-static void mcp2515_read_rxb0_complete(void *context)
+/* Read the interrupt flags.
+ * Asynchronous.*/
+static void mcp2515_read_flags(struct net_device *dev)
+{
+    __mcp2515_read_flags(dev, 0);
+}
+
+/* Read the status and, speculatively, receive buffer 0 in one message.
+ * RXB0 is read with the plain READ instruction, which leaves RX0IF alone:
+ * a frame landing in RXB0 after the status was read cannot be lost, and
+ * RX0IF is cleared by the next message when the frame was there.
+ * Asynchronous.*/
+static void mcp2515_read_spec(struct net_device *dev)
 {
-    struct net_device *dev = context;
     struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf;
+
+    mcp2515_message_init(dev);
+
+    buf = mcp2515_transfer(priv, 2);
+    buf[0] = 0xa0;  /* read status instruction */
+    buf[1] = 0; /* status */
+    priv->status_read = 1;
+    priv->status_idle = 0;
+    priv->stats.status_reads++;
+    priv->rx = buf + SPI_BUF_LEN;
+    priv->read_stamp = ktime_get_real();
+
+    /* instruction + address + id(4) + dlc + data(8) */
+    buf = mcp2515_transfer(priv, 15);
+    memset(buf, 0, 15);
+    buf[0] = 3; /* read instruction */
+    buf[1] = 0x61;  /* address of RXB0SIDH */
+    priv->complete = mcp2515_read_spec_complete;
 
-    mcp2515_read_rxb_complete(context);
+    mcp2515_spi_async(STAGE_READ_SPEC);
+}
+
+/* Read the interrupt flags after an interrupt.
+ * Asynchronous.*/
+static void mcp2515_read_flags_irq(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
 
-    if (priv->canintf & CANINTF_RX1IF)
-        mcp2515_read_rxb1(dev);
+    priv->irq_read = 1;
+    if (priv->priv_flags & PRIV_SPEC_RX)
+        mcp2515_read_spec(dev);
     else
-        mcp2515_transmit_or_read_flags(dev);
+        mcp2515_read_flags(dev);
 }
 
-/* Called when the "read receive buffer 1" SPI message completes.*/
-static void mcp2515_read_rxb1_complete(void *context)
+/* Return true if receive buffers should be read header first, then only
+ * the data bytes present.  That is 7 bytes, plus 1 + dlc bytes (or a 4-byte
+ * bit modify of RXnIF if no data) appended to the next message, against 14
+ * bytes for the whole buffer: the cost model assumes one more transfer in a
+ * message is worth RX_SPLIT_XFER_COST bytes and looks at the average data
+ * length received lately.*/
+#define RX_SPLIT_XFER_COST  2
+
+static int mcp2515_rx_split(struct mcp2515_priv *priv)
 {
-    struct net_device *dev = context;
+    unsigned dlc = (priv->rx_dlc_avg + 8) / 16;
+
+    if (priv->priv_flags & PRIV_RX_SPLIT)
+        return 1;
 
-    mcp2515_read_rxb_complete(context);
+    if (!(priv->priv_flags & PRIV_RX_SPLIT_AUTO))
+        return 0;
 
-    mcp2515_transmit_or_read_flags(dev);
+    return 7 + (dlc ? 1 + dlc : 4) + RX_SPLIT_XFER_COST < 14;
 }
 
-/* Called when the "clear CANINTF bits" SPI message completes.*/
-static void mcp2515_clear_canintf_complete(void *context)
+/* Read receive buffer N, in full or header first.
+ * Asynchronous.*/
+static void mcp2515_read_rxb(struct net_device *dev, unsigned n)
 {
-    struct net_device *dev = context;
     struct mcp2515_priv *priv = netdev_priv(dev);
-
-    if (priv->canintf & CANINTF_TX0IF) {
-        struct sk_buff *skb = priv->skb;
-        if (skb) {
-            struct can_frame *f = (struct can_frame *)skb->data;
-            dev->stats.tx_bytes += f->can_dlc;
-            dev->stats.tx_packets++;
-            can_put_echo_skb(skb, dev, 0);
-            can_get_echo_skb(dev, 0);
-        }
-        priv->skb = NULL;
-        netif_wake_queue(dev);
+    unsigned stage;
+    u8 *buf;
+
+    priv->rxb = n;
+    mcp2515_message_init(dev);
+
+    if (mcp2515_rx_split(priv)) {
+        /* instruction + address + id(4) + dlc */
+        buf = mcp2515_transfer(priv, 7);
+        memset(buf, 0, 7);
+        buf[0] = 3; /* read instruction */
+        buf[1] = 0x61 + 0x10 * n;   /* address of RXBnSIDH */
+        priv->rx = buf + SPI_BUF_LEN + 2;
+        priv->complete = mcp2515_read_rxb_head_complete;
+        priv->stats.rx_split_reads++;
+        stage = STAGE_READ_RXB_HEAD;
+    } else {
+        /* instruction + id(4) + dlc + data(8) */
+        buf = mcp2515_transfer(priv, 14);
+        memset(buf, 0, 14);
+        buf[0] = 0x90 | n << 2; /* read rx buffer at RXBnSIDH */
+        priv->rx = buf + SPI_BUF_LEN;
+        priv->complete = mcp2515_read_rxb_complete;
+        stage = STAGE_READ_RXB;
     }
 
-    if (priv->eflg)
-        mcp2515_clear_eflg(dev);
-    else
-        mcp2515_read_flags(dev);
+    mcp2515_spi_async(stage);
 }
 
-/* Called when the "clear EFLG bits" SPI message completes.*/
-static void mcp2515_clear_eflg_complete(void *context)
+/* Clear CANINTF bits.
+ * Asynchronous.*/
+static void mcp2515_clear_canintf(struct net_device *dev)
 {
-    struct net_device *dev = context;
     struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf;
 
-    /*
-     * The receive flow chart (figure 4-3) of the data sheet (DS21801E)
-     * says that, if RXB0CTRL.BUKT is set (our case), the overflow
-     * flag that is set is EFLG.RX1OVR, when in fact it is EFLG.RX0OVR
-     * that is set.  To be safe, we test for any one of them.
-     */
-    if (priv->eflg & (EFLG_RX0OVR | EFLG_RX1OVR))
-        dev->stats.rx_over_errors++;
+    mcp2515_message_init(dev);
+    buf = mcp2515_transfer(priv, 4);
+    buf[0] = 5; /* bit modify instruction */
+    buf[1] = 0x2c;  /* address of CANINTF */
+    buf[2] = priv->canintf & ~(CANINTF_RX0IF | CANINTF_RX1IF); /* mask */
+    buf[3] = 0; /* data */
+    priv->complete = mcp2515_clear_canintf_complete;
 
-    mcp2515_read_flags(dev);
+    mcp2515_spi_async(STAGE_CLEAR_CANINTF);
 }
 
-/* Interrupt handler.*/
-static irqreturn_t mcp2515_interrupt(int irq, void *dev_id)
+/* Clear EFLG bits.
+ * Asynchronous.*/
+static void mcp2515_clear_eflg(struct net_device *dev)
 {
-    struct net_device *dev = dev_id;
     struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf;
 
-    spin_lock(&priv->lock);
-    if (priv->busy) {
-        priv->interrupt = 1;
-        spin_unlock(&priv->lock);
-        return IRQ_HANDLED;
-    }
-    priv->busy = 1;
-    spin_unlock(&priv->lock);
-
-    mcp2515_read_flags(dev);
+    mcp2515_message_init(dev);
+    buf = mcp2515_transfer(priv, 4);
+    buf[0] = 5;     /* bit modify instruction */
+    buf[1] = 0x2d;      /* address of EFLG */
+    buf[2] = priv->eflg & (EFLG_RX0OVR | EFLG_RX1OVR);  /* mask */
+    buf[3] = 0;     /* data */
+    priv->complete = mcp2515_clear_eflg_complete;
 
-    return IRQ_HANDLED;
+    mcp2515_spi_async(STAGE_CLEAR_EFLG);
 }
 
-/************************************************************************/
+/* Return the length on the bus of a frame, in bytes of bit time, for Byte
+ * Queue Limits to bound the queueing delay in bus time: the overhead bits
+ * of a frame with a standard or extended identifier, plus the data.*/
+static unsigned mcp2515_tx_len(const struct can_frame *frame)
+{
+    return (frame->can_id & CAN_EFF_FLAG ? 8 : 6) +
+        (frame->can_id & CAN_RTR_FLAG ? 0 : frame->can_dlc);
+}
 
-/* Transmit a frame.*/
-static netdev_tx_t mcp2515_start_xmit(struct sk_buff *skb,
-                      struct net_device *dev)
+/* Return the transmit queue of the frame in buffer N.*/
+static struct netdev_queue *mcp2515_txq(struct net_device *dev, unsigned n)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    unsigned long flags;
 
-    if (can_dropped_invalid_skb(dev, skb))
-        return NETDEV_TX_OK;
+    return netdev_get_tx_queue(dev,
+                   priv->priv_flags & PRIV_TX_QUEUES ? n : 0);
+}
 
-    netif_stop_queue(dev);
-    priv->skb = skb;
+/* Set KEYS to the order keys of the frames in flight and return the key
+ * for the next frame, lower than all of them, or -1 if every transmit
+ * buffer is in flight.  When no free buffer has a key below the lowest
+ * one in flight, the keys in flight are renumbered from the top of the
+ * range, in the same order, to make room.*/
+static int mcp2515_tx_rekey(struct mcp2515_priv *priv, u8 *keys)
+{
+    int key = TX_KEYS;
+    int prev = TX_KEYS;
+    int i, n;
 
-    spin_lock_irqsave(&priv->lock, flags);
-    if (priv->busy) {
-        priv->transmit = 1;
-        spin_unlock_irqrestore(&priv->lock, flags);
-        return NETDEV_TX_OK;
+    if (priv->tx_busy == (1 << TXBS) - 1)
+        return -1;
+
+    for (i = 0; i < TXBS; i++) {
+        keys[i] = priv->tx_key[i];
+        if (priv->tx_busy & 1 << i && keys[i] < key)
+            key = keys[i];
     }
-    priv->busy = 1;
-    spin_unlock_irqrestore(&priv->lock, flags);
 
-    mcp2515_load_txb0(skb, dev);
+    for (i = key - 1; i >= 0; i--)
+        if (!(priv->tx_busy & 1 << i % TXBS))
+            return i;
+
+    /* From the first frame in flight to the last, give each the highest
+     * key of its buffer below the key of the one before. */
+    key = TX_KEYS;
+    for (;;) {
+        n = -1;
+        for (i = 0; i < TXBS; i++)
+            if (priv->tx_busy & 1 << i && priv->tx_key[i] < prev &&
+                (n < 0 || priv->tx_key[i] > priv->tx_key[n]))
+                n = i;
+        if (n < 0)
+            break;
+        prev = priv->tx_key[n];
+        key -= (key - n + TXBS - 1) % TXBS + 1;
+        keys[n] = key;
+    }
+
+    while (priv->tx_busy & 1 << --key % TXBS)
+        ;
+    return key;
+}
+
+/* Return the order key for the next frame to transmit, lower than the key
+ * of every frame in flight so that the controller sends them in the order
+ * they were queued, or -1 if no transmit buffer can take it yet.
+ * With a queue for each buffer, the key is that of the highest priority
+ * queue with a frame waiting and its buffer free.*/
+static int mcp2515_tx_key(struct mcp2515_priv *priv)
+{
+    u8 keys[TXBS];
+    int i;
+
+    if (priv->priv_flags & PRIV_TX_QUEUES) {
+        for (i = TXBS - 1; i >= 0; i--)
+            if (priv->tx_skb[i] && !(priv->tx_busy & 1 << i))
+                return i * TXBS + i;
+        return -1;
+    }
+
+    return mcp2515_tx_rekey(priv, keys);
+}
+
+/* Renumber the frames in flight as mcp2515_tx_rekey() does, changing their
+ * TXBnCTRL.TXP with BIT MODIFY instructions, first in flight first, so the
+ * order holds at each step.*/
+static void mcp2515_tx_rebase(struct mcp2515_priv *priv)
+{
+    u8 keys[TXBS];
+    int i, n;
+    u8 *buf;
+
+    if (priv->priv_flags & PRIV_TX_QUEUES ||
+        mcp2515_tx_rekey(priv, keys) < 0)
+        return;
+
+    for (;;) {
+        n = -1;
+        for (i = 0; i < TXBS; i++)
+            if (priv->tx_busy & 1 << i && keys[i] != priv->tx_key[i] &&
+                (n < 0 || keys[i] > keys[n]))
+                n = i;
+        if (n < 0)
+            break;
+
+        buf = mcp2515_transfer(priv, 4);
+        buf[0] = 5; /* bit modify instruction */
+        buf[1] = TXB0CTRL + 0x10 * n;   /* address of TXBnCTRL */
+        buf[2] = TXBCTRL_TXP;   /* mask */
+        buf[3] = keys[n] / TXBS;    /* data */
+        priv->tx_key[n] = keys[n];
+        priv->tx_txp[n] = keys[n] / TXBS;
+        priv->stats.tx_rebases++;
+    }
+}
+
+/* Write the frame of an skb, along with its priority, to the transmit
+ * buffer selected by KEY, request its transmission and read the flags,
+ * all in one SPI message.  The echo skb is kept in the slot of the buffer
+ * until its transmission completes.
+ * The identifier and data length last written to the buffer, and its
+ * priority, are kept: when the identifier and data length are the same,
+ * only the data is loaded, with the LOAD TX BUFFER instruction starting at
+ * TXBnD0, after a BIT MODIFY of TXBnCTRL.TXP if the priority changed; with
+ * a different identifier or data length but the same priority, the load
+ * starts at TXBnSIDH.
+ * Asynchronous.*/
+static void mcp2515_load_txb(struct sk_buff *skb, struct net_device *dev,
+                 int key)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct can_frame *frame = (struct can_frame *)skb->data;
+    unsigned n = key % TXBS;
+    u8 hdr[6];
+    u8 *buf;
+
+    hdr[0] = key / TXBS;    /* TXBnCTRL.TXP */
+
+/* Set the transmit buffer, starting at TXBnSIDH, for an skb.*/
+    if (frame->can_id & CAN_EFF_FLAG) {
+        hdr[1] = frame->can_id >> 21;
+        hdr[2] = (frame->can_id >> 13 & 0xe0) | 8 |
+            (frame->can_id >> 16 & 3);
+        hdr[3] = frame->can_id >> 8;
+        hdr[4] = frame->can_id;
+    } else {
+        hdr[1] = frame->can_id >> 3;
+        hdr[2] = frame->can_id << 5;
+        hdr[3] = 0;
+        hdr[4] = 0;
+    }
+
+    if (frame->can_id & CAN_RTR_FLAG)
+        hdr[5] = frame->can_dlc | 0x40;
+    else
+        hdr[5] = frame->can_dlc;
+
+    mcp2515_message_init(dev);
+    mcp2515_tx_rebase(priv);
+    if (priv->tx_hdr_valid & 1 << n && !memcmp(hdr + 1, priv->tx_hdr[n], 5)) {
+        if (hdr[0] != priv->tx_txp[n]) {
+            buf = mcp2515_transfer(priv, 4);
+            buf[0] = 5; /* bit modify instruction */
+            buf[1] = TXB0CTRL + 0x10 * n;   /* address of TXBnCTRL */
+            buf[2] = TXBCTRL_TXP;   /* mask */
+            buf[3] = hdr[0];    /* data */
+            priv->stats.tx_hdr_bytes_saved += 3;
+        } else {
+            priv->stats.tx_hdr_bytes_saved += 7;
+        }
+        buf = mcp2515_transfer(priv, 1 + frame->can_dlc);
+        buf[0] = 0x41 + 2 * n;  /* load tx buffer at TXBnD0 */
+        memcpy(buf + 1, frame->data, frame->can_dlc);
+    } else if (priv->tx_hdr_valid & 1 << n && hdr[0] == priv->tx_txp[n]) {
+        buf = mcp2515_transfer(priv, 6 + frame->can_dlc);
+        buf[0] = 0x40 + 2 * n;  /* load tx buffer at TXBnSIDH */
+        memcpy(buf + 1, hdr + 1, 5);
+        memcpy(buf + 6, frame->data, frame->can_dlc);
+        priv->stats.tx_hdr_bytes_saved += 2;
+    } else {
+        buf = mcp2515_transfer(priv, 8 + frame->can_dlc);
+        buf[0] = 2; /* write instruction */
+        buf[1] = TXB0CTRL + 0x10 * n;   /* address of TXBnCTRL */
+        memcpy(buf + 2, hdr, 6);
+        memcpy(buf + 8, frame->data, frame->can_dlc);
+    }
+    memcpy(priv->tx_hdr[n], hdr + 1, 5);
+    priv->tx_txp[n] = hdr[0];
+    priv->tx_hdr_valid |= 1 << n;
+
+    buf = mcp2515_transfer(priv, 1);
+    buf[0] = 0x80 | 1 << n; /* request to send txbn instruction */
+
+    mcp2515_add_read_flags(priv, 0);
+    priv->complete = mcp2515_read_flags_complete;
+
+    priv->tx_busy |= 1 << n;
+    priv->tx_key[n] = key;
+    priv->tx_dlc[n] = frame->can_dlc;
+    priv->tx_len[n] = mcp2515_tx_len(frame);
+    priv->tx_stamped &= ~(1 << n);
+    can_put_echo_skb(skb, dev, n);
+
+    mcp2515_spi_async(STAGE_LOAD_TXB);
+}
+
+static void mcp2515_pend(struct mcp2515_priv *priv, int bit);
+
+/* Load the skb waiting for a transmit buffer, and let the queue run again
+ * if another frame can follow it.  With a queue for each buffer, the queue
+ * can have its next frame wait while this one is in flight, and frames
+ * of other queues still wait.*/
+static void mcp2515_load_pending(struct net_device *dev, int key)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned q = priv->priv_flags & PRIV_TX_QUEUES ? key % TXBS : 0;
+    struct sk_buff *skb = priv->tx_skb[q];
+    unsigned i;
+
+    priv->tx_skb[q] = NULL;
+    mcp2515_load_txb(skb, dev, key);
+
+    if (!(priv->priv_flags & PRIV_TX_QUEUES)) {
+        if (mcp2515_tx_key(priv) >= 0)
+            netif_wake_queue(dev);
+        return;
+    }
+
+    netif_wake_subqueue(dev, q);
+    for (i = 0; i < TXBS; i++)
+        if (priv->tx_skb[i])
+            mcp2515_pend(priv, STATE_TRANSMIT);
+}
+
+/* Clear the state bit BIT, returning whether it was set.*/
+static int mcp2515_take(struct mcp2515_priv *priv, int bit)
+{
+    int old = atomic_read(&priv->state);
+    int prev;
+
+    while (old & bit) {
+        prev = atomic_cmpxchg(&priv->state, old, old & ~bit);
+        if (prev == old)
+            return 1;
+        old = prev;
+    }
+
+    return 0;
+}
+
+/* Go on when the chain has nothing else to do: transmit if transmission
+ * pending and a buffer free, else handle a pending interrupt, else go
+ * idle.  Going idle fails if a bit was set meanwhile, so no pending work
+ * is left behind.*/
+static void mcp2515_next(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    int old = atomic_read(&priv->state);
+    int prev;
+    int key;
+
+    for (;;) {
+        if (old & STATE_TRANSMIT && (key = mcp2515_tx_key(priv)) >= 0) {
+            prev = atomic_cmpxchg(&priv->state, old,
+                          old & ~STATE_TRANSMIT);
+            if (prev == old) {
+                mcp2515_load_pending(dev, key);
+                return;
+            }
+        } else if (old & STATE_INTERRUPT) {
+            prev = atomic_cmpxchg(&priv->state, old,
+                          old & ~STATE_INTERRUPT);
+            if (prev == old) {
+                mcp2515_read_flags_irq(dev);
+                return;
+            }
+        } else {
+            /* Done before going idle, so that once idle the chain
+             * no longer touches the device: an interrupt meanwhile
+             * sets STATE_INTERRUPT and going idle fails. */
+            if (test_and_clear_bit(MASK_LEVEL, &priv->irq_masked))
+                enable_irq(priv->spi->irq);
+            if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT &&
+                priv->tx_busy)
+                hrtimer_start(&priv->oneshot_timer,
+                          ns_to_ktime(priv->frame_ns),
+                          HRTIMER_MODE_REL);
+            prev = atomic_cmpxchg(&priv->state, old,
+                          old & ~STATE_BUSY);
+            if (prev == old) {
+                trace_mcp2515_idle(dev, prev & ~STATE_BUSY);
+                return;
+            }
+        }
+        old = prev;
+    }
+}
+
+/* Set the state bit BIT, from the chain.*/
+static void mcp2515_pend(struct mcp2515_priv *priv, int bit)
+{
+    int old = atomic_read(&priv->state);
+    int prev;
+
+    while ((prev = atomic_cmpxchg(&priv->state, old, old | bit)) != old)
+        old = prev;
+}
+
+/* Set the state bit BIT, and run the chain if it was idle.*/
+static void mcp2515_kick(struct net_device *dev, int bit)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    int old = atomic_read(&priv->state);
+    int prev;
+
+    while ((prev = atomic_cmpxchg(&priv->state, old,
+                      old | bit | STATE_BUSY)) != old)
+        old = prev;
+
+    if (!(old & STATE_BUSY))
+        mcp2515_next(dev);
+    else if (bit == STATE_INTERRUPT && !(old & STATE_INTERRUPT))
+        priv->stats.irq_restarts++;
+    else if (bit == STATE_TRANSMIT)
+        priv->stats.tx_deferred++;
+}
+
+/************************************************************************/
+
+/* Return the CANINTF bits given by the result of READ STATUS.*/
+static unsigned mcp2515_status_canintf(u8 status)
+{
+    return (status & (STATUS_RX0IF | STATUS_RX1IF)) |
+        (status & STATUS_TX0IF ? CANINTF_TX0IF : 0) |
+        (status & STATUS_TX1IF ? CANINTF_TX1IF : 0) |
+        (status & STATUS_TX2IF ? CANINTF_TX2IF : 0);
+}
+
+/* With one-shot transmission, find the buffers in flight whose request to
+ * send cleared without their TXnIF being set: their transmission failed
+ * and was not retried.*/
+static void mcp2515_tx_abort(struct mcp2515_priv *priv, u8 status)
+{
+    unsigned n;
+
+    if (!(priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT))
+        return;
+
+    for (n = 0; n < TXBS; n++)
+        if (priv->tx_busy & 1 << n &&
+            !(status & (STATUS_TX0REQ | STATUS_TX0IF) << 2 * n))
+            priv->tx_aborted |= 1 << n;
+}
+
+/* Return the error state given by the EFLG register.  While the controller
+ * recovers from bus-off after a restart, the restarted state holds.*/
+static enum can_state mcp2515_eflg_state(struct mcp2515_priv *priv)
+{
+    u8 eflg = priv->eflg;
+
+    if (eflg & EFLG_TXBO)
+        return priv->restarting ? priv->can.state : CAN_STATE_BUS_OFF;
+    if (eflg & (EFLG_TXEP | EFLG_RXEP))
+        return CAN_STATE_ERROR_PASSIVE;
+    if (eflg & EFLG_EWARN)
+        return CAN_STATE_ERROR_WARNING;
+    return CAN_STATE_ERROR_ACTIVE;
+}
+
+/* Timestamp the frames that the flags just read show in the receive
+ * buffers, and the completions of the transmit buffers, if not done yet.
+ * When both receive buffers are full, the frame in RXB1 came after the one
+ * in RXB0.*/
+static void mcp2515_stamp(struct mcp2515_priv *priv, unsigned canintf)
+{
+    ktime_t stamp = priv->read_stamp;
+    unsigned n;
+
+    if (ktime_after(priv->irq_stamp, priv->look_stamp))
+        stamp = priv->irq_stamp;
+
+    for (n = 0; n < 2; n++) {
+        if (!(canintf & CANINTF_RX0IF << n) ||
+            priv->rx_stamped & 1 << n)
+            continue;
+        priv->rx_stamp[n] = stamp;
+        priv->rx_stamped |= 1 << n;
+    }
+
+    if (priv->rx_stamped == 3 &&
+        ktime_before(priv->rx_stamp[1], priv->rx_stamp[0]))
+        priv->rx_stamp[1] = priv->rx_stamp[0];
+
+    for (n = 0; n < TXBS; n++) {
+        if (!(canintf & CANINTF_TX0IF << n) ||
+            priv->tx_stamped & 1 << n)
+            continue;
+        priv->tx_stamp[n] = stamp;
+        priv->tx_stamped |= 1 << n;
+    }
+
+    priv->look_stamp = priv->read_stamp;
+}
+
+/* Called when the "read interrupt flags" SPI message completes.*/
+static void mcp2515_read_flags_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf = priv->rx;
+    unsigned canintf;
+
+    if (priv->status_read) {
+        /*
+         * READ STATUS has no error or wake-up flags: when it shows
+         * nothing to do for an interrupt, read CANINTF and EFLG so
+         * that no pending interrupt is left behind.
+         */
+        canintf = mcp2515_status_canintf(buf[1]);
+        mcp2515_stamp(priv, canintf);
+        mcp2515_tx_abort(priv, buf[1]);
+        if (!canintf && !priv->status_idle) {
+            __mcp2515_read_flags(dev, 1);
+            return;
+        }
+        priv->canintf = canintf;
+        priv->eflg = 0;
+    } else {
+        priv->canintf = canintf = buf[2];
+        priv->eflg = buf[3];
+        priv->tec = priv->rx_ec[2];
+        priv->rec = priv->rx_ec[3];
+        mcp2515_stamp(priv, canintf);
+        if (priv->rx_status)
+            mcp2515_tx_abort(priv, priv->rx_status[1]);
+
+        if (!(priv->eflg & EFLG_TXBO))
+            priv->restarting = 0;
+
+        /* Catch up with an error state change without ERRIF. */
+        if (mcp2515_eflg_state(priv) != priv->can.state)
+            priv->canintf = canintf |= CANINTF_ERRIF;
+    }
+
+    trace_mcp2515_flags(dev, atomic_read(&priv->state), canintf,
+                priv->eflg, priv->status_read);
+
+    if (priv->wd_kick) {
+        priv->wd_kick = 0;
+        if (canintf)
+            priv->stats.watchdog_recoveries++;
+    }
+
+    if (canintf & CANINTF_RX0IF)
+        mcp2515_read_rxb(dev, 0);
+    else if (canintf & CANINTF_RX1IF)
+        mcp2515_read_rxb(dev, 1);
+    else if (canintf || priv->tx_aborted)
+        mcp2515_clear_canintf(dev);
+    else
+        mcp2515_next(dev);
+}
+
+/* Account for the time from the interrupt to passing up an skb.*/
+static void mcp2515_rx_delay(struct mcp2515_priv *priv, struct sk_buff *skb)
+{
+    s64 delay = ktime_to_ns(ktime_sub(ktime_get_real(),
+                      skb_hwtstamps(skb)->hwtstamp));
+
+    if (delay < 0)
+        return;
+
+    mcp2515_lat(priv->debug.rx_lat, delay);
+    priv->stats.rx_delay_ns += delay;
+    if (delay > priv->stats.rx_delay_max_ns)
+        priv->stats.rx_delay_max_ns = delay;
+}
+
+/* Schedule the NAPI poll, from whatever context the SPI completion runs.*/
+static void mcp2515_napi_schedule(struct mcp2515_priv *priv)
+{
+    if (in_irq()) {
+        napi_schedule(&priv->napi);
+    } else {
+        local_bh_disable();
+        napi_schedule(&priv->napi);
+        local_bh_enable();
+    }
+}
+
+/* Pass up a received skb: right away, or in NAPI mode through the ring,
+ * with the interrupt masked until the poll has emptied it.*/
+static void mcp2515_rx_skb(struct net_device *dev, struct sk_buff *skb)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned head = priv->rx_head;
+
+    if (!(priv->priv_flags & PRIV_NAPI)) {
+        mcp2515_rx_delay(priv, skb);
+        netif_rx(skb);
+        return;
+    }
+
+    if (head - ACCESS_ONCE(priv->rx_tail) == RX_RING) {
+        priv->stats.rx_ring_full++;
+        dev->stats.rx_dropped++;
+        kfree_skb(skb);
+        return;
+    }
+
+    priv->rx_ring[head % RX_RING] = skb;
+    smp_wmb();  /* ring entry before head */
+    priv->rx_head = head + 1;
+
+    if (!priv->polling && !test_and_set_bit(MASK_NAPI, &priv->irq_masked))
+        disable_irq_nosync(priv->spi->irq);
+
+    mcp2515_napi_schedule(priv);
+}
+
+/* NAPI poll: pass up the frames staged in the ring.*/
+static int mcp2515_poll(struct napi_struct *napi, int budget)
+{
+    struct mcp2515_priv *priv = container_of(napi, struct mcp2515_priv,
+                         napi);
+    unsigned tail = priv->rx_tail;
+    int done = 0;
+
+    while (done < budget && tail != ACCESS_ONCE(priv->rx_head)) {
+        smp_rmb();  /* head before ring entry */
+        mcp2515_rx_delay(priv, priv->rx_ring[tail % RX_RING]);
+        netif_receive_skb(priv->rx_ring[tail % RX_RING]);
+        priv->rx_ring[tail % RX_RING] = NULL;
+        tail++;
+        done++;
+        smp_mb();   /* ring entry freed before tail */
+        priv->rx_tail = tail;
+    }
+
+    if (done)
+        priv->stats.napi_polls++;
+
+    if (done < budget) {
+        napi_complete(napi);
+        if (test_and_clear_bit(MASK_NAPI, &priv->irq_masked))
+            enable_irq(priv->spi->irq);
+        /* A frame staged after the loop, before napi_complete(). */
+        if (tail != ACCESS_ONCE(priv->rx_head))
+            napi_schedule(napi);
+    }
+
+    return done;
+}
+
+/* Free the frames left in the ring.*/
+static void mcp2515_rx_ring_purge(struct mcp2515_priv *priv)
+{
+    while (priv->rx_tail != priv->rx_head) {
+        kfree_skb(priv->rx_ring[priv->rx_tail % RX_RING]);
+        priv->rx_ring[priv->rx_tail % RX_RING] = NULL;
+        priv->rx_tail++;
+    }
+}
+
+/* Fill the pool of receive skbs.*/
+static void mcp2515_pool_refill(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned head = priv->pool_head;
+    struct can_frame *frame;
+    struct sk_buff *skb;
+
+    while (head - ACCESS_ONCE(priv->pool_tail) < RX_POOL) {
+        skb = alloc_can_skb(dev, &frame);
+        if (!skb)
+            break;
+        priv->pool[head % RX_POOL] = skb;
+        smp_wmb();  /* pool entry before head */
+        priv->pool_head = ++head;
+    }
+}
+
+/* Work refilling the pool of receive skbs, out of the SPI completions.*/
+static void mcp2515_pool_work(struct work_struct *work)
+{
+    struct mcp2515_priv *priv = container_of(work, struct mcp2515_priv,
+                         pool_work);
+
+    mcp2515_pool_refill(priv->dev);
+}
+
+/* Take a receive skb from the pool, asking for a refill when it runs low.
+ * Only when the pool is empty is an skb allocated here.*/
+static struct sk_buff *mcp2515_pool_get(struct net_device *dev,
+                    struct can_frame **frame)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned tail = priv->pool_tail;
+    unsigned avail = ACCESS_ONCE(priv->pool_head) - tail;
+    struct sk_buff *skb;
+
+    if (avail <= RX_POOL / 2)
+        schedule_work(&priv->pool_work);
+
+    if (!avail) {
+        priv->stats.rx_pool_misses++;
+        return alloc_can_skb(dev, frame);
+    }
+
+    smp_rmb();  /* head before pool entry */
+    skb = priv->pool[tail % RX_POOL];
+    priv->pool[tail % RX_POOL] = NULL;
+    smp_mb();   /* pool entry taken before tail */
+    priv->pool_tail = tail + 1;
+
+    *frame = (struct can_frame *)skb->data;
+
+    return skb;
+}
+
+/* Free the skbs left in the pool.*/
+static void mcp2515_pool_purge(struct mcp2515_priv *priv)
+{
+    while (priv->pool_tail != priv->pool_head) {
+        kfree_skb(priv->pool[priv->pool_tail % RX_POOL]);
+        priv->pool[priv->pool_tail % RX_POOL] = NULL;
+        priv->pool_tail++;
+    }
+}
+
+/* Account for a frame received with BYTES bytes clocked on SPI.*/
+static void mcp2515_rx_bytes(struct mcp2515_priv *priv, unsigned bytes)
+{
+    unsigned i = bytes <= 8 ? 0 : (bytes - 7) / 2;
+
+    priv->stats.rx_spi_bytes[min(i, RX_BYTES_BUCKETS - 1u)]++;
+}
+
+/* Pass up a received frame, given the 5 bytes of receive buffer N from
+ * RXBnSIDH to RXBnDLC and its data bytes.*/
+static void mcp2515_rx_frame(struct net_device *dev, unsigned n,
+                 const u8 *buf, const u8 *data)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct sk_buff *skb;
+    struct can_frame *frame;
+
+    priv->rx_stamped &= ~(1 << n);
+
+    skb = mcp2515_pool_get(dev, &frame);
+    if (!skb) {
+        dev->stats.rx_dropped++;
+        return;
+    }
+
+    skb->tstamp = priv->rx_stamp[n];
+    skb_hwtstamps(skb)->hwtstamp = priv->rx_stamp[n];
+
+    if (buf[1] & RXBSIDL_IDE) {
+        frame->can_id = buf[0] << 21 | (buf[1] & 0xe0) << 13 |
+            (buf[1] & 3) << 16 | buf[2] << 8 | buf[3] |
+             CAN_EFF_FLAG;
+        if (buf[4] & RXBDLC_RTR)
+            frame->can_id |= CAN_RTR_FLAG;
+    } else {
+        frame->can_id = buf[0] << 3 | buf[1] >> 5;
+        if (buf[1] & RXBSIDL_SRR)
+            frame->can_id |= CAN_RTR_FLAG;
+    }
+
+    frame->can_dlc = get_can_dlc(buf[4] & 0xf);
+
+    if (!(frame->can_id & CAN_RTR_FLAG))
+        memcpy(frame->data, data, frame->can_dlc);
+
+    /* Moving average of the data length, with a weight of 1/16. */
+    priv->rx_dlc_avg += frame->can_dlc - priv->rx_dlc_avg / 16;
+
+    dev->stats.rx_packets++;
+    dev->stats.rx_bytes += frame->can_dlc;
+
+    trace_mcp2515_rx(dev, atomic_read(&priv->state), n, frame->can_id,
+             frame->can_dlc, priv->rx_stamp[n]);
+
+    mcp2515_rx_skb(dev, skb);
+}
+
+/* Common completion of the SPI messages of the chain: pass up a frame whose
+ * data came with the message, then go on with the step that sent it.*/
+static void mcp2515_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    trace_mcp2515_complete(dev, atomic_read(&priv->state), priv->stage,
+                   priv->canintf, priv->eflg, priv->msg_bytes);
+    mcp2515_lat(priv->debug.stage_lat[priv->stage],
+            ktime_to_ns(ktime_sub(ktime_get(),
+                      priv->debug.submit_stamp)));
+    mcp2515_bus_done(priv);
+    priv->irq_read = 0;
+
+    if (priv->split_data) {
+        mcp2515_rx_frame(dev, priv->split_rxb, priv->split_hdr,
+                 priv->split_data);
+        priv->split_data = NULL;
+    }
+
+    priv->complete(context);
+}
+
+/* Transmit a frame if transmission pending, else read and process flags.*/
+static void mcp2515_transmit_or_read_flags(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    int key = mcp2515_tx_key(priv);
+
+    if (key >= 0 && mcp2515_take(priv, STATE_TRANSMIT))
+        mcp2515_load_pending(dev, key);
+    else
+        mcp2515_read_flags(dev);
+}
+
+/* Go on after reading receive buffer N.*/
+static void mcp2515_read_rxb_next(struct net_device *dev, unsigned n)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    if (n == 0 && priv->canintf & CANINTF_RX1IF)
+        mcp2515_read_rxb(dev, 1);
+    else
+        mcp2515_transmit_or_read_flags(dev);
+}
+
+/* Called when the "read receive buffer n" SPI message completes.*/
+static void mcp2515_read_rxb_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf = priv->rx;
+
+    mcp2515_rx_frame(dev, priv->rxb, buf + 1, buf + 6);
+    mcp2515_rx_bytes(priv, 14);
+
+    mcp2515_read_rxb_next(dev, priv->rxb);
+}
+
+/* Called when the "read receive buffer n header" SPI message completes.
+ * The data bytes are read by the next message, or if there are none, its
+ * RXnIF is cleared by it.*/
+static void mcp2515_read_rxb_head_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 *buf = priv->rx;
+    unsigned len = get_can_dlc(buf[4] & 0xf);
+
+    /* Remote frames have no data bytes. */
+    if (buf[1] & RXBSIDL_IDE ? buf[4] & RXBDLC_RTR : buf[1] & RXBSIDL_SRR)
+        len = 0;
+
+    if (len) {
+        memcpy(priv->split_hdr, buf, 5);
+        priv->split_rxb = priv->rxb;
+        priv->split_len = len;
+        mcp2515_rx_bytes(priv, 7 + 1 + len);
+    } else {
+        mcp2515_rx_frame(dev, priv->rxb, buf, NULL);
+        priv->clear_rxif |= CANINTF_RX0IF << priv->rxb;
+        mcp2515_rx_bytes(priv, 7 + 4);
+    }
+
+    mcp2515_read_rxb_next(dev, priv->rxb);
+}
+
+/* Called when the "read status and receive buffer 0" SPI message completes.*/
+static void mcp2515_read_spec_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    u8 status = priv->rx[1];
+    u8 *buf;
+
+    if (!(status & STATUS_RX0IF)) {
+        priv->stats.spec_rx_misses++;
+        mcp2515_read_flags_complete(context);
+        return;
+    }
+
+    priv->stats.spec_rx_hits++;
+    priv->canintf = mcp2515_status_canintf(status);
+    mcp2515_stamp(priv, priv->canintf);
+    priv->eflg = 0;
+    trace_mcp2515_flags(dev, atomic_read(&priv->state), priv->canintf,
+                0, 1);
+    priv->clear_rxif |= CANINTF_RX0IF;
+
+    if (priv->wd_kick) {
+        priv->wd_kick = 0;
+        priv->stats.watchdog_recoveries++;
+    }
+
+    /* The frame follows the instruction and address bytes. */
+    buf = (u8 *)priv->transfer[priv->xfers - 1].rx_buf + 2;
+    mcp2515_rx_frame(dev, 0, buf, buf + 5);
+    mcp2515_rx_bytes(priv, 15);
+
+    mcp2515_read_rxb_next(dev, 0);
+}
+
+/* Called when the error storm is over: enable error interrupts again.*/
+static enum hrtimer_restart mcp2515_err_timer(struct hrtimer *timer)
+{
+    struct mcp2515_priv *priv = container_of(timer, struct mcp2515_priv,
+                         err_timer);
+
+    priv->inte = CANINTE_MERRE | CANINTE_ERRIE;
+    smp_wmb();  /* inte before update */
+    set_bit(UPDATE_INTE, &priv->update);
+    mcp2515_kick(priv->dev, STATE_INTERRUPT);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Count an error interrupt, and disable error interrupts for a while if
+ * there are so many that they would monopolise the SPI bus.*/
+static void mcp2515_error_limit(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    if (time_after(jiffies, priv->err_window +
+               msecs_to_jiffies(ERR_WINDOW_MS))) {
+        priv->err_window = jiffies;
+        priv->err_count = 0;
+    }
+
+    if (++priv->err_count != ERR_LIMIT)
+        return;
+
+    priv->stats.err_storms++;
+    priv->inte = 0;
+    smp_wmb();  /* inte before update */
+    set_bit(UPDATE_INTE, &priv->update);
+    hrtimer_start(&priv->err_timer, ms_to_ktime(ERR_WINDOW_MS),
+              HRTIMER_MODE_REL);
+}
+
+/* Hold the controller off the bus until restarted, instead of letting it
+ * recover by itself, with the frames in flight kept for the restart.*/
+static void mcp2515_bus_off(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    int n;
+
+    for (n = 0; n < TXBS; n++) {
+        if (!(priv->tx_busy & 1 << n))
+            continue;
+        priv->tx_stash[n] = priv->can.echo_skb[n];
+        priv->can.echo_skb[n] = NULL;
+    }
+
+    priv->canctrl = CANCTRL_REQOP_CONF;
+    smp_wmb();  /* canctrl before update */
+    set_bit(UPDATE_CANCTRL, &priv->update);
+
+    can_bus_off(dev);
+}
+
+/* Track the error state and pass up an error frame for the errors shown
+ * by the last flags read: state changes, receive overflows and, if bus
+ * error reporting is on, message errors.*/
+static void mcp2515_error(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    enum can_state state = mcp2515_eflg_state(priv);
+    enum can_state old_state = priv->can.state;
+    u8 eflg = priv->eflg;
+    struct can_frame err = { .can_id = 0 };
+    struct can_frame *frame;
+    struct sk_buff *skb;
+
+    mcp2515_error_limit(dev);
+
+    if (state != old_state) {
+        switch (state) {
+        case CAN_STATE_ERROR_WARNING:
+            if (state > old_state)
+                priv->can.can_stats.error_warning++;
+            err.can_id |= CAN_ERR_CRTL;
+            err.data[1] |= (eflg & EFLG_TXWAR ?
+                    CAN_ERR_CRTL_TX_WARNING : 0) |
+                (eflg & EFLG_RXWAR ? CAN_ERR_CRTL_RX_WARNING : 0);
+            break;
+        case CAN_STATE_ERROR_PASSIVE:
+            if (state > old_state)
+                priv->can.can_stats.error_passive++;
+            err.can_id |= CAN_ERR_CRTL;
+            err.data[1] |= (eflg & EFLG_TXEP ?
+                    CAN_ERR_CRTL_TX_PASSIVE : 0) |
+                (eflg & EFLG_RXEP ? CAN_ERR_CRTL_RX_PASSIVE : 0);
+            break;
+        case CAN_STATE_BUS_OFF:
+            err.can_id |= CAN_ERR_BUSOFF;
+            break;
+        default:
+#ifdef CAN_ERR_CRTL_ACTIVE
+            err.can_id |= CAN_ERR_CRTL;
+            err.data[1] |= CAN_ERR_CRTL_ACTIVE;
+#endif
+            break;
+        }
+        priv->can.state = state;
+    }
+
+    /*
+     * The receive flow chart (figure 4-3) of the data sheet (DS21801E)
+     * says that, if RXB0CTRL.BUKT is set (our case), the overflow
+     * flag that is set is EFLG.RX1OVR, when in fact it is EFLG.RX0OVR
+     * that is set.  To be safe, we test for any one of them.
+     */
+    if (eflg & (EFLG_RX0OVR | EFLG_RX1OVR)) {
+        dev->stats.rx_over_errors++;
+        dev->stats.rx_errors++;
+        err.can_id |= CAN_ERR_CRTL;
+        err.data[1] |= CAN_ERR_CRTL_RX_OVERFLOW;
+    }
+
+    if (priv->canintf & CANINTF_MERRF) {
+        priv->can.can_stats.bus_error++;
+        if (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)
+            err.can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+    }
+
+    if (err.can_id) {
+        skb = alloc_can_err_skb(dev, &frame);
+        if (skb) {
+            frame->can_id |= err.can_id;
+            memcpy(frame->data, err.data, sizeof(err.data));
+            frame->data[6] = priv->tec;
+            frame->data[7] = priv->rec;
+            skb->tstamp = priv->read_stamp;
+            skb_hwtstamps(skb)->hwtstamp = priv->read_stamp;
+            dev->stats.rx_packets++;
+            dev->stats.rx_bytes += frame->can_dlc;
+            mcp2515_rx_skb(dev, skb);
+        }
+    }
+
+    if (state == CAN_STATE_BUS_OFF && old_state != CAN_STATE_BUS_OFF)
+        mcp2515_bus_off(dev);
+}
+
+/* Timestamp the echo skb of transmit buffer N with the time of the
+ * interrupt that signalled its completion, report that time to the
+ * socket if it asked for transmit timestamps, and trace the completion.*/
+static void mcp2515_tx_stamp(struct net_device *dev, unsigned n)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct sk_buff *skb = priv->can.echo_skb[n];
+    struct skb_shared_hwtstamps hwts;
+    ktime_t stamp = priv->read_stamp;
+
+    if (!skb)
+        return;
+
+    if (priv->tx_stamped & 1 << n)
+        stamp = priv->tx_stamp[n];
+    priv->tx_stamped &= ~(1 << n);
+
+    skb->tstamp = stamp;
+    memset(&hwts, 0, sizeof(hwts));
+    hwts.hwtstamp = stamp;
+    *skb_hwtstamps(skb) = hwts;
+
+    if (skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS)
+        skb_tstamp_tx(skb, &hwts);
+
+    trace_mcp2515_tx_done(dev, atomic_read(&priv->state), n,
+                  ((struct can_frame *)skb->data)->can_id, stamp);
+}
+
+/* Called when the "clear CANINTF bits" SPI message completes.*/
+static void mcp2515_clear_canintf_complete(void *context)
+{
+    struct net_device *dev = context;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned n;
+
+    for (n = 0; n < TXBS; n++) {
+        if (!(priv->canintf & CANINTF_TX0IF << n) ||
+            !(priv->tx_busy & 1 << n))
+            continue;
+        dev->stats.tx_bytes += priv->tx_dlc[n];
+        dev->stats.tx_packets++;
+        mcp2515_tx_stamp(dev, n);
+        can_get_echo_skb(dev, n);
+        priv->tx_busy &= ~(1 << n);
+        netdev_tx_completed_queue(mcp2515_txq(dev, n), 1,
+                      priv->tx_len[n]);
+    }
+
+    for (n = 0; n < TXBS; n++) {
+        if (!(priv->tx_aborted & 1 << n) ||
+            !(priv->tx_busy & 1 << n))
+            continue;
+        dev->stats.tx_errors++;
+        dev->stats.tx_aborted_errors++;
+        can_free_echo_skb(dev, n);
+        priv->tx_busy &= ~(1 << n);
+        netdev_tx_completed_queue(mcp2515_txq(dev, n), 1,
+                      priv->tx_len[n]);
+    }
+    priv->tx_aborted = 0;
+
+    /* A buffer freed: let the queue run if nothing waits for one.
+     * The skb is set before the queue is stopped. */
+    if (priv->priv_flags & PRIV_TX_QUEUES) {
+        for (n = 0; n < TXBS; n++) {
+            if (!__netif_subqueue_stopped(dev, n))
+                continue;
+            smp_rmb();
+            if (!priv->tx_skb[n])
+                netif_wake_subqueue(dev, n);
+        }
+    } else if (netif_queue_stopped(dev)) {
+        smp_rmb();
+        if (!priv->tx_skb[0] && mcp2515_tx_key(priv) >= 0)
+            netif_wake_queue(dev);
+    }
+
+    if (priv->canintf & (CANINTF_ERRIF | CANINTF_MERRF))
+        mcp2515_error(dev);
+
+    if (priv->eflg & (EFLG_RX0OVR | EFLG_RX1OVR))
+        mcp2515_clear_eflg(dev);
+    else
+        mcp2515_read_flags(dev);
+}
+
+/* Called when the "clear EFLG bits" SPI message completes.*/
+static void mcp2515_clear_eflg_complete(void *context)
+{
+    struct net_device *dev = context;
+
+    mcp2515_read_flags(dev);
+}
+
+/* Interrupt handler.*/
+static irqreturn_t mcp2515_interrupt(int irq, void *dev_id)
+{
+    struct net_device *dev = dev_id;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    priv->irq_stamp = ktime_get_real();
+    priv->stats.interrupts++;
+    trace_mcp2515_interrupt(dev, atomic_read(&priv->state),
+                priv->irq_stamp);
+
+    /* A level interrupt stays masked until the chain goes idle, as it
+     * stays asserted until the chain clears the flags. */
+    if (priv->priv_flags & PRIV_LEVEL_IRQ &&
+        !test_and_set_bit(MASK_LEVEL, &priv->irq_masked))
+        disable_irq_nosync(irq);
+
+    /* With coalescing, let more frames arrive before reading them;
+     * the interrupt stays asserted, or masked, until then. */
+    if (priv->coalesce_ns && !priv->tx_busy &&
+        !(atomic_read(&priv->state) & STATE_BUSY)) {
+        if (!hrtimer_active(&priv->coalesce_timer)) {
+            priv->stats.coalesced_irqs++;
+            hrtimer_start(&priv->coalesce_timer,
+                      ns_to_ktime(priv->coalesce_ns),
+                      HRTIMER_MODE_REL);
+        }
+        return IRQ_HANDLED;
+    }
+
+    mcp2515_kick(dev, STATE_INTERRUPT);
+
+    return IRQ_HANDLED;
+}
+
+/* Called when the deferral of a coalesced interrupt is over.*/
+static enum hrtimer_restart mcp2515_coalesce_timer(struct hrtimer *timer)
+{
+    struct mcp2515_priv *priv = container_of(timer, struct mcp2515_priv,
+                         coalesce_timer);
+
+    mcp2515_kick(priv->dev, STATE_INTERRUPT);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Called a frame time after the chain went idle with one-shot
+ * transmissions in flight, to see whether some were aborted.*/
+static enum hrtimer_restart mcp2515_oneshot_timer(struct hrtimer *timer)
+{
+    struct mcp2515_priv *priv = container_of(timer, struct mcp2515_priv,
+                         oneshot_timer);
+
+    mcp2515_kick(priv->dev, STATE_INTERRUPT);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Set the deferral of the flags read for an interrupt: rx_usecs, but no
+ * longer than a frame at the bit rate, lest a third frame overflow the
+ * two receive buffers, and none if a read for each frame is asked for.*/
+static void mcp2515_coalesce_update(struct mcp2515_priv *priv)
+{
+    u32 bitrate = priv->can.bittiming.bitrate;
+    u64 ns = (u64)priv->rx_usecs * NSEC_PER_USEC;
+    u64 budget;
+
+    if (!bitrate || priv->rx_frames == 1) {
+        priv->coalesce_ns = 0;
+        return;
+    }
+
+    budget = div_u64((u64)MIN_FRAME_BITS * NSEC_PER_SEC, bitrate);
+    priv->coalesce_ns = min(ns, budget);
+}
+
+/* Sum of the flags reads started so far.*/
+static u64 mcp2515_flags_reads(struct mcp2515_priv *priv)
+{
+    return ACCESS_ONCE(priv->stats.status_reads) +
+        ACCESS_ONCE(priv->stats.flag_reads);
+}
+
+/* Sum of the frames sent, aborted or dropped so far.*/
+static unsigned long mcp2515_tx_done(struct net_device *dev)
+{
+    return ACCESS_ONCE(dev->stats.tx_packets) +
+        ACCESS_ONCE(dev->stats.tx_aborted_errors) +
+        ACCESS_ONCE(dev->stats.tx_dropped);
+}
+
+/* Queue a frame of stress thread SEQ for transmission, through the
+ * queueing discipline as from a socket, but without its echo.  Return
+ * whether it was queued.*/
+static int mcp2515_stress_xmit(struct net_device *dev, u32 seq)
+{
+    struct can_frame *frame;
+    struct sk_buff *skb;
+
+    skb = alloc_can_skb(dev, &frame);
+    if (!skb)
+        return 0;
+
+    frame->can_id = STRESS_CAN_ID;
+    frame->can_dlc = 4;
+    memcpy(frame->data, &seq, 4);
+
+    return dev_queue_xmit(skb) == NET_XMIT_SUCCESS;
+}
+
+/* Stress thread: raise bursts of simulated interrupts, and send frames in
+ * between, racing with the interrupt handler, other transmissions and the
+ * other stress threads.  After each burst, the chain must start a flags
+ * read, and all the frames must be sent, aborted or dropped, or stashed by
+ * a bus-off, else a wake-up was lost.  The frames need a node, or the
+ * loopback mode, to acknowledge them.*/
+static int mcp2515_stress(void *data)
+{
+    struct net_device *dev = data;
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned long timeout, target;
+    u32 seq = 0;
+    u64 reads;
+    unsigned i;
+
+    while (!kthread_should_stop()) {
+        target = mcp2515_tx_done(dev);
+        for (i = 0; i < 1000; i++) {
+            if (i % (1000 / STRESS_FRAMES) == 0 &&
+                mcp2515_stress_xmit(dev, seq++))
+                target++;
+            priv->irq_stamp = ktime_get_real();
+            mcp2515_kick(dev, STATE_INTERRUPT);
+        }
+
+        reads = mcp2515_flags_reads(priv);
+        timeout = jiffies + HZ;
+        while (mcp2515_flags_reads(priv) == reads ||
+               ((long)(mcp2515_tx_done(dev) - target) < 0 &&
+                priv->can.state != CAN_STATE_BUS_OFF)) {
+            if (time_after(jiffies, timeout)) {
+                priv->stats.stress_lost++;
+                netdev_err(dev, "stress: lost wake-up, state %x, "
+                       "%ld frames left\n",
+                       atomic_read(&priv->state),
+                       (long)(target - mcp2515_tx_done(dev)));
+                break;
+            }
+            usleep_range(100, 200);
+        }
+        priv->stats.stress_checks++;
+
+        usleep_range(1000, 2000);
+    }
+
+    return 0;
+}
+
+/* Start the stress threads asked for by the module parameter.*/
+static void mcp2515_stress_start(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct task_struct *task;
+    unsigned i;
+
+    for (i = 0; i < stress_threads && i < STRESS_THREADS; i++) {
+        task = kthread_run(mcp2515_stress, dev, "%s-stress%u",
+                   dev->name, i);
+        if (IS_ERR(task)) {
+            netdev_err(dev, "cannot start stress thread\n");
+            break;
+        }
+        priv->stress[i] = task;
+    }
+}
+
+/* Read the flags every poll period when polling.  Else, as a watchdog for
+ * lost interrupts, read the flags if the chain stayed idle for a whole
+ * period, with the controller on the bus.*/
+static enum hrtimer_restart mcp2515_poll_timer(struct hrtimer *timer)
+{
+    struct mcp2515_priv *priv = container_of(timer, struct mcp2515_priv,
+                         poll_timer);
+    struct net_device *dev = priv->dev;
+
+    if (priv->polling) {
+        priv->irq_stamp = ktime_get_real();
+        mcp2515_kick(dev, STATE_INTERRUPT);
+        hrtimer_forward_now(timer, ns_to_ktime(priv->poll_ns));
+        return HRTIMER_RESTART;
+    }
+
+    if (mcp2515_flags_reads(priv) == priv->wd_reads &&
+        !(atomic_read(&priv->state) & STATE_BUSY) &&
+        priv->can.state != CAN_STATE_BUS_OFF) {
+        priv->wd_kick = 1;
+        mcp2515_kick(dev, STATE_INTERRUPT);
+    }
+    priv->wd_reads = mcp2515_flags_reads(priv);
+
+    hrtimer_forward_now(timer, ms_to_ktime(priv->watchdog_ms));
+    return HRTIMER_RESTART;
+}
+
+/* Stop the stress threads.*/
+static void mcp2515_stress_stop(struct mcp2515_priv *priv)
+{
+    unsigned i;
+
+    for (i = 0; i < STRESS_THREADS; i++) {
+        if (priv->stress[i]) {
+            kthread_stop(priv->stress[i]);
+            priv->stress[i] = NULL;
+        }
+    }
+}
+
+/************************************************************************/
+
+/* Transmit a frame.*/
+static netdev_tx_t mcp2515_start_xmit(struct sk_buff *skb,
+                      struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned q = skb_get_queue_mapping(skb);
+
+    if (can_dropped_invalid_skb(dev, skb))
+        return NETDEV_TX_OK;
+
+    trace_mcp2515_xmit(dev, atomic_read(&priv->state), q,
+               ((struct can_frame *)skb->data)->can_id,
+               ((struct can_frame *)skb->data)->can_dlc);
+
+    if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY) {
+        dev->stats.tx_dropped++;
+        kfree_skb(skb);
+        return NETDEV_TX_OK;
+    }
+
+    if (skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP &&
+        priv->hwts.tx_type == HWTSTAMP_TX_ON)
+        skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+    skb_tx_timestamp(skb);
+
+    netdev_tx_sent_queue(netdev_get_tx_queue(dev, q),
+                 mcp2515_tx_len((struct can_frame *)skb->data));
+
+    /* Without a suitable free buffer, the frame waits for the
+     * transmit interrupt of a buffer in flight to restart the chain. */
+    priv->tx_skb[q] = skb;
+    smp_wmb();  /* skb before stopped queue */
+    netif_stop_subqueue(dev, q);
+    mcp2515_kick(dev, STATE_TRANSMIT);
 
     return NETDEV_TX_OK;
 }
 
-/* Called when the network device transitions to the up state.*/
-static int mcp2515_open(struct net_device *dev)
+/* Called when the network device transitions to the up state.*/
+static int mcp2515_open(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct spi_device *spi = priv->spi;
+    unsigned n;
+    int err;
+
+    err = mcp2515_reset(spi);
+    if (err)
+        return err;
+
+    err = open_candev(dev);
+    if (err)
+        return err;
+
+    memset(priv->tx_skb, 0, sizeof(priv->tx_skb));
+    priv->tx_busy = 0;
+    atomic_set(&priv->state, 0);
+    priv->clear_rxif = 0;
+    priv->split_len = 0;
+    priv->split_data = NULL;
+    priv->irq_masked = 0;
+    priv->rx_stamped = 0;
+    priv->tx_stamped = 0;
+    priv->tx_hdr_valid = 0;
+    priv->update = 0;
+    priv->restarting = 0;
+    priv->err_count = 0;
+    priv->err_window = jiffies;
+    priv->tec = 0;
+    priv->rec = 0;
+    priv->can.state = CAN_STATE_ERROR_ACTIVE;
+    priv->wd_kick = 0;
+    priv->wd_reads = 0;
+    mcp2515_coalesce_update(priv);
+    priv->frame_ns = div_u64((u64)MAX_FRAME_BITS * NSEC_PER_SEC,
+                 priv->can.bittiming.bitrate);
+    priv->tx_aborted = 0;
+    priv->polling = priv->poll_us || spi->irq <= 0;
+    priv->poll_ns = (u64)(priv->poll_us ? priv->poll_us : POLL_US) *
+        NSEC_PER_USEC;
+    mcp2515_pool_refill(dev);
+
+    /* Frames may be received as soon as the interrupt is requested and
+     * the controller configured; with NAPI, the interrupt is masked until
+     * the poll, which must be able to run by then. */
+    napi_enable(&priv->napi);
+
+    if (!priv->polling) {
+        err = request_irq(spi->irq, mcp2515_interrupt,
+                  priv->priv_flags & PRIV_LEVEL_IRQ ?
+                  IRQF_TRIGGER_LOW : IRQF_TRIGGER_FALLING,
+                  dev->name, dev);
+        if (err)
+            goto err1;
+    }
+
+    err = mcp2515_config(dev);
+    if (err)
+        goto err2;
+
+    for (n = 0; n < dev->real_num_tx_queues; n++)
+        netdev_tx_reset_queue(netdev_get_tx_queue(dev, n));
+    netif_tx_wake_all_queues(dev);
+    if (priv->polling)
+        hrtimer_start(&priv->poll_timer, ns_to_ktime(priv->poll_ns),
+                  HRTIMER_MODE_REL);
+    else if (priv->watchdog_ms)
+        hrtimer_start(&priv->poll_timer,
+                  ms_to_ktime(priv->watchdog_ms),
+                  HRTIMER_MODE_REL);
+    mcp2515_stress_start(dev);
+
+    return 0;
+
+err2:   mcp2515_reset(spi);
+    if (!priv->polling)
+        free_irq(spi->irq, dev);
+err1:   napi_disable(&priv->napi);
+    mcp2515_pool_purge(priv);
+    close_candev(dev);
+    return err;
+}
+
+/* Wait for the chain to go idle for good: drop the work pending for it,
+ * wait for its message in flight, then cancel the timers it arms, until
+ * none of them started it again.  Nothing else may start it by then.*/
+static void mcp2515_quiesce(struct mcp2515_priv *priv)
+{
+    do {
+        mcp2515_take(priv, STATE_TRANSMIT | STATE_INTERRUPT);
+        while (atomic_read(&priv->state) & STATE_BUSY)
+            usleep_range(100, 200);
+        hrtimer_cancel(&priv->oneshot_timer);
+        hrtimer_cancel(&priv->err_timer);
+    } while (atomic_read(&priv->state) & STATE_BUSY);
+}
+
+/* Called when the network device transitions to the down state.*/
+static int mcp2515_stop(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct spi_device *spi = priv->spi;
+    int n;
+
+    mcp2515_stress_stop(priv);
+    /* The interrupt handler arms the coalescing timer: no interrupt
+     * until the interrupt is freed. */
+    if (!priv->polling)
+        disable_irq(spi->irq);
+    hrtimer_cancel(&priv->poll_timer);
+    hrtimer_cancel(&priv->coalesce_timer);
+    mcp2515_quiesce(priv);
+    mcp2515_reset(spi);
+    close_candev(dev);
+
+    napi_disable(&priv->napi);
+    if (test_and_clear_bit(MASK_NAPI, &priv->irq_masked))
+        enable_irq(spi->irq);
+    if (test_and_clear_bit(MASK_LEVEL, &priv->irq_masked))
+        enable_irq(spi->irq);
+    if (!priv->polling)
+        free_irq(spi->irq, dev);
+    mcp2515_rx_ring_purge(priv);
+
+    cancel_work_sync(&priv->pool_work);
+    mcp2515_pool_purge(priv);
+
+    for (n = 0; n < TXBS; n++) {
+        if (priv->tx_skb[n]) {
+            dev_kfree_skb(priv->tx_skb[n]);
+            priv->tx_skb[n] = NULL;
+        }
+        if (priv->tx_stash[n]) {
+            dev_kfree_skb(priv->tx_stash[n]);
+            priv->tx_stash[n] = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* Set up the SPI buffer.*/
+static void mcp2515_setup_spi_messages(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct device *device;
+    void *buf;
+    dma_addr_t dma;
+
+    spi_message_init(&priv->message);
+
+    /* FIXME */
+    device = &priv->spi->dev;
+    device->coherent_dma_mask = 0xffffffff;
+
+    buf = dma_alloc_coherent(device, 2 * SPI_BUF_LEN, &dma, GFP_KERNEL);
+    if (buf) {
+        priv->buf = buf;
+        priv->dma = dma;
+        priv->message.is_dma_mapped = 1;
+    } else {
+        priv->buf = priv->spi_buf;
+    }
+}
+
+/* Restart after bus-off: back to normal mode, the controller then goes
+ * through its bus-off recovery sequence and sends the frames in flight
+ * again, as the next message of the SPI state machine asks.*/
+static int mcp2515_set_mode(struct net_device *dev, enum can_mode mode)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    int n;
+
+    if (mode != CAN_MODE_START)
+        return -EOPNOTSUPP;
+
+    for (n = 0; n < TXBS; n++) {
+        if (!priv->tx_stash[n])
+            continue;
+        priv->can.echo_skb[n] = priv->tx_stash[n];
+        priv->tx_stash[n] = NULL;
+    }
+
+    priv->restarting = 1;
+    priv->can.state = CAN_STATE_ERROR_ACTIVE;
+    priv->canctrl = mcp2515_canctrl(priv) & CANCTRL_REQOP_MASK;
+    smp_wmb();  /* canctrl and restarting before update */
+    set_bit(UPDATE_CANCTRL, &priv->update);
+    set_bit(UPDATE_RTS, &priv->update);
+    mcp2515_kick(dev, STATE_INTERRUPT);
+
+    return 0;
+}
+
+/* Return the error counters, as of the last full flags read.*/
+static int mcp2515_get_berr_counter(const struct net_device *dev,
+                    struct can_berr_counter *bec)
+{
+    const struct mcp2515_priv *priv = netdev_priv(dev);
+
+    bec->txerr = priv->tec;
+    bec->rxerr = priv->rec;
+
+    return 0;
+}
+
+/* Get or set the timestamping configuration.  The "hardware" timestamps
+ * are the times of the interrupts, taken with the system clock: frames
+ * are always stamped when received, and transmit completions are reported
+ * to the sockets that ask for them with HWTSTAMP_TX_ON.*/
+static int mcp2515_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    struct spi_device *spi = priv->spi;
-    int err;
+    struct hwtstamp_config config;
+
+    switch (cmd) {
+    case SIOCSHWTSTAMP:
+        if (copy_from_user(&config, ifr->ifr_data, sizeof(config)))
+            return -EFAULT;
+        if (config.flags)
+            return -EINVAL;
+        if (config.tx_type != HWTSTAMP_TX_OFF &&
+            config.tx_type != HWTSTAMP_TX_ON)
+            return -ERANGE;
+        if (config.rx_filter != HWTSTAMP_FILTER_NONE)
+            config.rx_filter = HWTSTAMP_FILTER_ALL;
+        priv->hwts = config;
+        /* fall through */
+    case SIOCGHWTSTAMP:
+        if (copy_to_user(ifr->ifr_data, &priv->hwts, sizeof(priv->hwts)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
 
-    err = mcp2515_reset(spi);
+/* Network device operations.*/
+static const struct net_device_ops mcp2515_netdev_ops = {
+    .ndo_open = mcp2515_open,
+    .ndo_stop = mcp2515_stop,
+    .ndo_start_xmit = mcp2515_start_xmit,
+    .ndo_do_ioctl = mcp2515_ioctl,
+};
+
+static const char mcp2515_priv_flags_strings[][ETH_GSTRING_LEN] = {
+    "status-read",
+    "spec-rx",
+    "rx-split-read",
+    "rx-split-auto",
+    "napi",
+    "level-irq",
+    "tx-prio-queues",
+};
+
+/* Default mapping of the socket priority onto the transmit queues, that
+ * is the TXP priority of the frames: 0 to 3 low, 4 and 5 middle, 6 and up
+ * high.*/
+static const u8 mcp2515_prio_tc[TC_BITMASK + 1] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2
+};
+
+#define MCP2515_STAT(name) { #name, offsetof(struct mcp2515_stats, name) }
+
+static const struct {
+    const char *name;
+    size_t offset;
+} mcp2515_stats_desc[] = {
+    MCP2515_STAT(spi_messages),
+    MCP2515_STAT(spi_transfers),
+    MCP2515_STAT(spi_bytes),
+    MCP2515_STAT(tx_spi_messages),
+    MCP2515_STAT(tx_spi_messages_per_frame_x100),
+    MCP2515_STAT(status_reads),
+    MCP2515_STAT(flag_reads),
+    MCP2515_STAT(spec_rx_hits),
+    MCP2515_STAT(spec_rx_misses),
+    MCP2515_STAT(rx_split_reads),
+    MCP2515_STAT(napi_polls),
+    MCP2515_STAT(rx_ring_full),
+    MCP2515_STAT(rx_pool_depth),
+    MCP2515_STAT(rx_pool_misses),
+    MCP2515_STAT(rx_delay_ns),
+    MCP2515_STAT(rx_delay_max_ns),
+    MCP2515_STAT(err_storms),
+    MCP2515_STAT(tx_hdr_bytes_saved),
+    MCP2515_STAT(tx_rebases),
+    MCP2515_STAT(interrupts),
+    MCP2515_STAT(watchdog_recoveries),
+    MCP2515_STAT(coalesced_irqs),
+    MCP2515_STAT(rx_frames_per_irq_x100),
+    MCP2515_STAT(irq_restarts),
+    MCP2515_STAT(stress_checks),
+    MCP2515_STAT(stress_lost),
+    MCP2515_STAT(spi_errors),
+    MCP2515_STAT(tx_deferred),
+    MCP2515_STAT(bus_waits),
+    MCP2515_STAT(bus_wait_ns),
+    MCP2515_STAT(bus_wait_max_ns),
+    { "rx_spi_bytes_le8", offsetof(struct mcp2515_stats, rx_spi_bytes[0]) },
+    { "rx_spi_bytes_le10", offsetof(struct mcp2515_stats, rx_spi_bytes[1]) },
+    { "rx_spi_bytes_le12", offsetof(struct mcp2515_stats, rx_spi_bytes[2]) },
+    { "rx_spi_bytes_le14", offsetof(struct mcp2515_stats, rx_spi_bytes[3]) },
+    { "rx_spi_bytes_le16", offsetof(struct mcp2515_stats, rx_spi_bytes[4]) },
+    { "rx_spi_bytes_gt16", offsetof(struct mcp2515_stats, rx_spi_bytes[5]) },
+};
+
+static void mcp2515_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    unsigned i;
+
+    switch (sset) {
+    case ETH_SS_STATS:
+        for (i = 0; i < ARRAY_SIZE(mcp2515_stats_desc); i++)
+            strlcpy(data + i * ETH_GSTRING_LEN,
+                mcp2515_stats_desc[i].name, ETH_GSTRING_LEN);
+        break;
+    case ETH_SS_PRIV_FLAGS:
+        memcpy(data, mcp2515_priv_flags_strings,
+               sizeof(mcp2515_priv_flags_strings));
+        break;
+    }
+}
+
+static int mcp2515_get_sset_count(struct net_device *dev, int sset)
+{
+    switch (sset) {
+    case ETH_SS_STATS:
+        return ARRAY_SIZE(mcp2515_stats_desc);
+    case ETH_SS_PRIV_FLAGS:
+        return ARRAY_SIZE(mcp2515_priv_flags_strings);
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static u32 mcp2515_get_priv_flags(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    return priv->priv_flags;
+}
+
+/* Use a transmit queue for each buffer, with the socket priorities mapped
+ * onto them by traffic class, or a single queue.*/
+static void mcp2515_set_tx_queues(struct net_device *dev, int on)
+{
+    unsigned i;
+
+    if (!on) {
+        netdev_reset_tc(dev);
+        netif_set_real_num_tx_queues(dev, 1);
+        return;
+    }
+
+    netif_set_real_num_tx_queues(dev, TXBS);
+    netdev_set_num_tc(dev, TXBS);
+    for (i = 0; i < TXBS; i++)
+        netdev_set_tc_queue(dev, i, 1, i);
+    for (i = 0; i <= TC_BITMASK; i++)
+        netdev_set_prio_tc_map(dev, i, mcp2515_prio_tc[i]);
+}
+
+static int mcp2515_set_priv_flags(struct net_device *dev, u32 flags)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+
+    if (flags & ~((1 << ARRAY_SIZE(mcp2515_priv_flags_strings)) - 1))
+        return -EINVAL;
+
+    if ((flags ^ priv->priv_flags) & PRIV_DOWN_ONLY && netif_running(dev))
+        return -EBUSY;
+
+    if ((flags ^ priv->priv_flags) & PRIV_TX_QUEUES) {
+        if (dev->num_tx_queues < TXBS)
+            return -EOPNOTSUPP;
+        mcp2515_set_tx_queues(dev, flags & PRIV_TX_QUEUES);
+    }
+
+    priv->priv_flags = flags;
+
+    return 0;
+}
+
+static void mcp2515_get_ethtool_stats(struct net_device *dev,
+                      struct ethtool_stats *stats, u64 *data)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    unsigned i;
+
+    priv->stats.rx_pool_depth = priv->pool_head - priv->pool_tail;
+    if (priv->stats.interrupts)
+        priv->stats.rx_frames_per_irq_x100 =
+            div64_u64((u64)dev->stats.rx_packets * 100,
+                  priv->stats.interrupts);
+    if (dev->stats.tx_packets)
+        priv->stats.tx_spi_messages_per_frame_x100 =
+            div64_u64(priv->stats.tx_spi_messages * 100,
+                  dev->stats.tx_packets);
+
+    for (i = 0; i < ARRAY_SIZE(mcp2515_stats_desc); i++)
+        data[i] = *(u64 *)((u8 *)&priv->stats +
+                   mcp2515_stats_desc[i].offset);
+}
+
+/* Show the acceptance filters set, as "id:mask" pairs in hexadecimal.*/
+static ssize_t mcp2515_show_hw_filter(struct device *d,
+                      struct device_attribute *attr, char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+    ssize_t len = 0;
+    unsigned i;
+
+    for (i = 0; i < priv->filters; i++) {
+        canid_t id = priv->filter[i].can_id;
+
+        len += sprintf(buf + len, id & CAN_EFF_FLAG ? "%s%08x:%08x" :
+                   "%s%03x:%03x", i ? " " : "", id & CAN_EFF_MASK,
+                   priv->filter[i].can_mask & CAN_EFF_MASK);
+    }
+    len += sprintf(buf + len, "\n");
+
+    return len;
+}
+
+/* Set the acceptance filters from "id:mask" pairs in hexadecimal, with
+ * identifiers above 7ff or 8 digits long for extended frames, or none to
+ * receive any message.  Only while the device is down.*/
+static ssize_t mcp2515_store_hw_filter(struct device *d,
+                       struct device_attribute *attr,
+                       const char *buf, size_t count)
+{
+    struct net_device *dev = to_net_dev(d);
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct can_filter filter[HW_FILTERS];
+    char *str, *p, *tok;
+    unsigned n = 0, id, mask, len;
+    int err = 0;
+
+    str = kstrndup(buf, count, GFP_KERNEL);
+    if (!str)
+        return -ENOMEM;
+
+    p = str;
+    while ((tok = strsep(&p, " ,\t\n"))) {
+        if (!*tok)
+            continue;
+        len = strcspn(tok, ":");
+        if (n == HW_FILTERS || sscanf(tok, "%x:%x", &id, &mask) != 2 ||
+            id > CAN_EFF_MASK) {
+            err = -EINVAL;
+            break;
+        }
+        if (id > CAN_SFF_MASK || len == 8)
+            id |= CAN_EFF_FLAG;
+        filter[n].can_id = id;
+        filter[n].can_mask = mask & CAN_EFF_MASK;
+        n++;
+    }
+    kfree(str);
     if (err)
         return err;
 
-    err = open_candev(dev);
+    if (!rtnl_trylock())
+        return restart_syscall();
+
+    if (netif_running(dev)) {
+        rtnl_unlock();
+        return -EBUSY;
+    }
+
+    memcpy(priv->filter, filter, n * sizeof(*filter));
+    priv->filters = n;
+    if (n)
+        mcp2515_fit_filters(priv);
+
+    rtnl_unlock();
+
+    return count;
+}
+
+/* Show the acceptance masks and filters written to the controller.*/
+static ssize_t mcp2515_show_hw_filter_regs(struct device *d,
+                       struct device_attribute *attr,
+                       char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+    ssize_t len = 0;
+    unsigned i;
+
+    if (!priv->filters)
+        return sprintf(buf, "any\n");
+
+    for (i = 0; i < 6; i++) {
+        if (i == 0 || i == 2)
+            len += sprintf(buf + len, "RXM%u %08x\n", i / 2,
+                       priv->rxm[i / 2]);
+        len += sprintf(buf + len, "RXF%u %08x %s\n", i,
+                   priv->rxf[i].id, priv->rxf[i].ext ? "ext" : "std");
+    }
+
+    return len;
+}
+
+/* Set a period from a decimal number, only while the device is down.*/
+static ssize_t mcp2515_store_period(struct device *d, const char *buf,
+                    size_t count, unsigned *period)
+{
+    struct net_device *dev = to_net_dev(d);
+    unsigned value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
     if (err)
         return err;
 
-    err = request_irq(spi->irq, mcp2515_interrupt,
-              IRQF_TRIGGER_FALLING, dev->name, dev);
-    if (err)
-        goto err1;
+    if (!rtnl_trylock())
+        return restart_syscall();
 
-    err = mcp2515_config(dev);
+    if (netif_running(dev)) {
+        rtnl_unlock();
+        return -EBUSY;
+    }
+
+    *period = value;
+
+    rtnl_unlock();
+
+    return count;
+}
+
+/* Show the period of the lost interrupt watchdog, in milliseconds.*/
+static ssize_t mcp2515_show_watchdog_ms(struct device *d,
+                    struct device_attribute *attr, char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return sprintf(buf, "%u\n", priv->watchdog_ms);
+}
+
+/* Set the period of the lost interrupt watchdog, 0 for none.*/
+static ssize_t mcp2515_store_watchdog_ms(struct device *d,
+                     struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return mcp2515_store_period(d, buf, count, &priv->watchdog_ms);
+}
+
+/* Show the period of the flags reads when polling, in microseconds.*/
+static ssize_t mcp2515_show_poll_us(struct device *d,
+                    struct device_attribute *attr, char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return sprintf(buf, "%u\n", priv->poll_us);
+}
+
+/* Set the period of the flags reads, to poll them instead of using the
+ * interrupt, or 0 to use the interrupt if the device has one.*/
+static ssize_t mcp2515_store_poll_us(struct device *d,
+                     struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return mcp2515_store_period(d, buf, count, &priv->poll_us);
+}
+
+/* Show the priority of the device on a shared SPI bus.*/
+static ssize_t mcp2515_show_bus_prio(struct device *d,
+                     struct device_attribute *attr, char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return sprintf(buf, "%u\n", priv->bus_prio);
+}
+
+/* Set the priority of the device on a shared SPI bus, 0 the highest: its
+ * messages go before those of the same class of lower priority devices.*/
+static ssize_t mcp2515_store_bus_prio(struct device *d,
+                      struct device_attribute *attr,
+                      const char *buf, size_t count)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+    unsigned value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
     if (err)
-        goto err2;
+        return err;
+    if (value >= BUS_PRIOS)
+        return -EINVAL;
 
-    netif_wake_queue(dev);
+    priv->bus_prio = value;
 
-    return 0;
+    return count;
+}
 
-err2:   mcp2515_reset(spi);
-    free_irq(spi->irq, dev);
-err1:   close_candev(dev);
-    return err;
+/* Show the weight of the device on a shared SPI bus.*/
+static ssize_t mcp2515_show_bus_weight(struct device *d,
+                       struct device_attribute *attr, char *buf)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+
+    return sprintf(buf, "%u\n", priv->bus_weight);
 }
 
-/* Called when the network device transitions to the down state.*/
-static int mcp2515_stop(struct net_device *dev)
+/* Set the weight of the device on a shared SPI bus, from 1 to 256: among
+ * devices of the same priority, each gets bus time in proportion to it.*/
+static ssize_t mcp2515_store_bus_weight(struct device *d,
+                    struct device_attribute *attr,
+                    const char *buf, size_t count)
+{
+    struct mcp2515_priv *priv = netdev_priv(to_net_dev(d));
+    unsigned value;
+    int err;
+
+    err = kstrtouint(buf, 10, &value);
+    if (err)
+        return err;
+    if (!value || value > BUS_WEIGHTS)
+        return -EINVAL;
+
+    priv->bus_weight = value;
+
+    return count;
+}
+
+static DEVICE_ATTR(hw_filter, S_IRUGO | S_IWUSR, mcp2515_show_hw_filter,
+           mcp2515_store_hw_filter);
+static DEVICE_ATTR(hw_filter_regs, S_IRUGO, mcp2515_show_hw_filter_regs,
+           NULL);
+
+static DEVICE_ATTR(watchdog_ms, S_IRUGO | S_IWUSR, mcp2515_show_watchdog_ms,
+           mcp2515_store_watchdog_ms);
+static DEVICE_ATTR(bus_prio, S_IRUGO | S_IWUSR, mcp2515_show_bus_prio,
+           mcp2515_store_bus_prio);
+static DEVICE_ATTR(bus_weight, S_IRUGO | S_IWUSR, mcp2515_show_bus_weight,
+           mcp2515_store_bus_weight);
+static DEVICE_ATTR(poll_us, S_IRUGO | S_IWUSR, mcp2515_show_poll_us,
+           mcp2515_store_poll_us);
+
+static struct attribute *mcp2515_attrs[] = {
+    &dev_attr_hw_filter.attr,
+    &dev_attr_hw_filter_regs.attr,
+    &dev_attr_watchdog_ms.attr,
+    &dev_attr_poll_us.attr,
+    &dev_attr_bus_prio.attr,
+    &dev_attr_bus_weight.attr,
+    NULL
+};
+
+static const struct attribute_group mcp2515_attr_group = {
+    .attrs = mcp2515_attrs,
+};
+
+/* Get the interrupt coalescing.*/
+static int mcp2515_get_coalesce(struct net_device *dev,
+                struct ethtool_coalesce *ec)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    struct spi_device *spi = priv->spi;
 
-    mcp2515_reset(spi);
-    close_candev(dev);
-    free_irq(spi->irq, dev);
+    ec->rx_coalesce_usecs = priv->rx_usecs;
+    ec->rx_max_coalesced_frames = priv->rx_frames;
 
     return 0;
 }
 
-/* Set up SPI messages.*/
-static void mcp2515_setup_spi_messages(struct net_device *dev)
+/* Set the interrupt coalescing: rx-usecs, the deferral of the flags read,
+ * bounded by the receive buffer rollover, and rx-frames, the frames the
+ * two receive buffers may hold when read (0 or 2, or 1 for no deferral).*/
+static int mcp2515_set_coalesce(struct net_device *dev,
+                struct ethtool_coalesce *ec)
 {
     struct mcp2515_priv *priv = netdev_priv(dev);
-    struct device *device;
-    void *buf;
-    dma_addr_t dma;
 
-    spi_message_init(&priv->message);
-    priv->message.context = dev;
+    if (ec->rx_max_coalesced_frames > 2)
+        return -EINVAL;
 
-    /* FIXME */
-    device = &priv->spi->dev;
-    device->coherent_dma_mask = 0xffffffff;
+    priv->rx_usecs = ec->rx_coalesce_usecs;
+    priv->rx_frames = ec->rx_max_coalesced_frames;
+    mcp2515_coalesce_update(priv);
 
-    buf = dma_alloc_coherent(device, 32, &dma, GFP_KERNEL);
-    if (buf) {
-        priv->transfer.tx_buf = buf;
-        priv->transfer.rx_buf = buf + 16;
-        priv->transfer.tx_dma = dma;
-        priv->transfer.rx_dma = dma + 16;
-        priv->message.is_dma_mapped = 1;
-    } else {
-        priv->transfer.tx_buf = priv->tx_buf;
-        priv->transfer.rx_buf = priv->rx_buf;
-    }
+    return 0;
+}
+
+static int mcp2515_get_ts_info(struct net_device *dev,
+                   struct ethtool_ts_info *info)
+{
+    info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+        SOF_TIMESTAMPING_RX_SOFTWARE |
+        SOF_TIMESTAMPING_SOFTWARE |
+        SOF_TIMESTAMPING_TX_HARDWARE |
+        SOF_TIMESTAMPING_RX_HARDWARE |
+        SOF_TIMESTAMPING_RAW_HARDWARE;
+    info->phc_index = -1;
+    info->tx_types = 1 << HWTSTAMP_TX_OFF | 1 << HWTSTAMP_TX_ON;
+    info->rx_filters = 1 << HWTSTAMP_FILTER_NONE |
+        1 << HWTSTAMP_FILTER_ALL;
 
-    spi_message_add_tail(&priv->transfer, &priv->message);
+    return 0;
 }
 
-static int mcp2515_set_mode(struct net_device *dev, enum can_mode mode)
+/* Ethtool operations.*/
+static const struct ethtool_ops mcp2515_ethtool_ops = {
+    .get_ts_info = mcp2515_get_ts_info,
+    .get_coalesce = mcp2515_get_coalesce,
+    .set_coalesce = mcp2515_set_coalesce,
+    .get_strings = mcp2515_get_strings,
+    .get_sset_count = mcp2515_get_sset_count,
+    .get_ethtool_stats = mcp2515_get_ethtool_stats,
+    .get_priv_flags = mcp2515_get_priv_flags,
+    .set_priv_flags = mcp2515_set_priv_flags,
+};
+
+/************************************************************************/
+
+/* Directory of the devices in debugfs */
+static struct dentry *mcp2515_debugfs;
+
+static const char *const mcp2515_instr_names[INSTRS] = {
+    "write", "read", "bit_modify", "load_tx", "rts", "read_rx",
+    "read_status", "rx_status", "reset",
+};
+
+static const char *const mcp2515_stage_names[STAGES] = {
+    "read_flags", "read_spec", "read_rxb", "read_rxb_head",
+    "clear_canintf", "clear_eflg", "load_txb",
+};
+
+/* Show the count and bytes of each SPI instruction.*/
+static int mcp2515_instructions_show(struct seq_file *m, void *v)
 {
+    struct mcp2515_priv *priv = m->private;
+    unsigned n;
+
+    for (n = 0; n < INSTRS; n++)
+        seq_printf(m, "%-12s %12llu %14llu\n", mcp2515_instr_names[n],
+               priv->debug.instr[n], priv->debug.instr_bytes[n]);
+
     return 0;
 }
 
-/* Network device operations.*/
-static const struct net_device_ops mcp2515_netdev_ops = {
-    .ndo_open = mcp2515_open,
-    .ndo_stop = mcp2515_stop,
-    .ndo_start_xmit = mcp2515_start_xmit,
+/* Show the nonzero buckets of the latency histogram HIST.*/
+static void mcp2515_lat_show(struct seq_file *m, const char *name,
+                 const u64 *hist)
+{
+    unsigned n;
+
+    seq_printf(m, "%s:\n", name);
+    for (n = 0; n < LAT_BUCKETS; n++)
+        if (hist[n])
+            seq_printf(m, "  %10llu ns %12llu\n", 1ULL << n,
+                   hist[n]);
+}
+
+/* Show the latency histograms of each step of the chain, from the
+ * submission of its SPI message to its completion, of the frames
+ * received, from the interrupt to passing them up, and of the waits for
+ * a shared bus.*/
+static int mcp2515_latency_show(struct seq_file *m, void *v)
+{
+    struct mcp2515_priv *priv = m->private;
+    unsigned n;
+
+    for (n = 0; n < STAGES; n++)
+        mcp2515_lat_show(m, mcp2515_stage_names[n],
+                 priv->debug.stage_lat[n]);
+    mcp2515_lat_show(m, "rx_delay", priv->debug.rx_lat);
+    mcp2515_lat_show(m, "bus_wait", priv->debug.bus_lat);
+
+    return 0;
+}
+
+static int mcp2515_instructions_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, mcp2515_instructions_show, inode->i_private);
+}
+
+static int mcp2515_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, mcp2515_latency_show, inode->i_private);
+}
+
+static const struct file_operations mcp2515_instructions_fops = {
+    .owner = THIS_MODULE,
+    .open = mcp2515_instructions_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations mcp2515_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = mcp2515_latency_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
 };
 
+/* Create the debugfs directory of the device, named after the SPI device
+ * as the interface can be renamed.  Without debugfs, there is none.*/
+static void mcp2515_debugfs_init(struct net_device *dev)
+{
+    struct mcp2515_priv *priv = netdev_priv(dev);
+    struct dentry *dir;
+
+    if (IS_ERR_OR_NULL(mcp2515_debugfs))
+        return;
+
+    dir = debugfs_create_dir(dev_name(&priv->spi->dev), mcp2515_debugfs);
+    if (IS_ERR_OR_NULL(dir))
+        return;
+    priv->debug.dir = dir;
+
+    debugfs_create_u64("spi_messages", S_IRUGO, dir,
+               &priv->stats.spi_messages);
+    debugfs_create_u64("spi_errors", S_IRUGO, dir,
+               &priv->stats.spi_errors);
+    debugfs_create_u64("spi_transfers", S_IRUGO, dir,
+               &priv->stats.spi_transfers);
+    debugfs_create_u64("spi_bytes", S_IRUGO, dir, &priv->stats.spi_bytes);
+    debugfs_create_u64("irq_restarts", S_IRUGO, dir,
+               &priv->stats.irq_restarts);
+    debugfs_create_u64("tx_deferred", S_IRUGO, dir,
+               &priv->stats.tx_deferred);
+    debugfs_create_file("instructions", S_IRUGO, dir, priv,
+                &mcp2515_instructions_fops);
+    debugfs_create_file("latency", S_IRUGO, dir, priv,
+                &mcp2515_latency_fops);
+}
+
+/************************************************************************/
+
+/* SPI buses with devices of this driver */
+static LIST_HEAD(mcp2515_buses);
+static DEFINE_MUTEX(mcp2515_bus_mutex);
+
+/* Join the device to the bus of its SPI master, shared with the other
+ * devices of this driver on it.*/
+static int mcp2515_bus_get(struct mcp2515_priv *priv)
+{
+    struct spi_master *master = priv->spi->master;
+    struct mcp2515_bus *bus;
+
+    mutex_lock(&mcp2515_bus_mutex);
+
+    list_for_each_entry(bus, &mcp2515_buses, node)
+        if (bus->master == master)
+            goto found;
+
+    bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (!bus) {
+        mutex_unlock(&mcp2515_bus_mutex);
+        return -ENOMEM;
+    }
+    bus->master = master;
+    spin_lock_init(&bus->lock);
+    INIT_LIST_HEAD(&bus->wait);
+    list_add(&bus->node, &mcp2515_buses);
+
+found:
+    bus->users++;
+    priv->bus = bus;
+    INIT_LIST_HEAD(&priv->bus_node);
+    priv->bus_prio = BUS_PRIO;
+    priv->bus_weight = BUS_WEIGHT;
+
+    mutex_unlock(&mcp2515_bus_mutex);
+
+    return 0;
+}
+
+/* Leave the bus, freeing it after its last device.*/
+static void mcp2515_bus_put(struct mcp2515_priv *priv)
+{
+    struct mcp2515_bus *bus = priv->bus;
+    unsigned long flags;
+
+    mutex_lock(&mcp2515_bus_mutex);
+
+    spin_lock_irqsave(&bus->lock, flags);
+    list_del_init(&priv->bus_node);
+    spin_unlock_irqrestore(&bus->lock, flags);
+
+    /* Let the other devices go on without our last message. */
+    mcp2515_bus_done(priv);
+
+    if (!--bus->users) {
+        list_del(&bus->node);
+        kfree(bus);
+    }
+    priv->bus = NULL;
+
+    mutex_unlock(&mcp2515_bus_mutex);
+}
+
 /* Binds this driver to the spi device.*/
 #define __devinit
 static int __devinit mcp2515_probe(struct spi_device *spi)
@@ -652,32 +3492,68 @@ static int __devinit mcp2515_probe(struct spi_device *spi)
     if (err)
         return err;
 
-    dev = alloc_candev(sizeof(struct mcp2515_priv), 1);
+    /* alloc_candev() is a macro where there are multiqueue devices. */
+#ifdef alloc_candev
+    dev = alloc_candev_mqs(sizeof(struct mcp2515_priv), TXBS, TXBS, 1);
     if (!dev)
         return -ENOMEM;
+    netif_set_real_num_tx_queues(dev, 1);
+#else
+    dev = alloc_candev(sizeof(struct mcp2515_priv), TXBS);
+    if (!dev)
+        return -ENOMEM;
+#endif
 
     dev_set_drvdata(&spi->dev, dev);
     SET_NETDEV_DEV(dev, &spi->dev);
 
     dev->netdev_ops = &mcp2515_netdev_ops;
+    dev->ethtool_ops = &mcp2515_ethtool_ops;
+    dev->sysfs_groups[0] = &mcp2515_attr_group;
     dev->flags |= IFF_ECHO;
 
     priv = netdev_priv(dev);
     priv->can.bittiming_const = &mcp2515_bittiming_const;
     priv->can.do_set_mode = mcp2515_set_mode;
+    priv->can.do_get_berr_counter = mcp2515_get_berr_counter;
+    priv->can.ctrlmode_supported = CAN_CTRLMODE_3_SAMPLES |
+        CAN_CTRLMODE_BERR_REPORTING | CAN_CTRLMODE_ONE_SHOT |
+        CAN_CTRLMODE_LISTENONLY | CAN_CTRLMODE_LOOPBACK;
     priv->can.clock.freq = pdata->oscillator_frequency / 2;
     priv->spi = spi;
-
-    spin_lock_init(&priv->lock);
+    priv->dev = dev;
+
+    netif_napi_add(dev, &priv->napi, mcp2515_poll, RX_RING);
+    INIT_WORK(&priv->pool_work, mcp2515_pool_work);
+    hrtimer_init(&priv->err_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->err_timer.function = mcp2515_err_timer;
+    hrtimer_init(&priv->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->poll_timer.function = mcp2515_poll_timer;
+    hrtimer_init(&priv->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->coalesce_timer.function = mcp2515_coalesce_timer;
+    hrtimer_init(&priv->oneshot_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->oneshot_timer.function = mcp2515_oneshot_timer;
+    priv->watchdog_ms = WATCHDOG_MS;
 
     mcp2515_setup_spi_messages(dev);
 
+    err = mcp2515_bus_get(priv);
+    if (err) {
+        netif_napi_del(&priv->napi);
+        free_candev(dev);
+        return err;
+    }
+
     err = register_candev(dev);
     if (err) {
+        mcp2515_bus_put(priv);
+        netif_napi_del(&priv->napi);
         free_candev(dev);
         return err;
     }
 
+    mcp2515_debugfs_init(dev);
+
     netdev_info(dev, "device registered (cs=%u, irq=%d)\n",
          spi->chip_select, spi->irq);
 
@@ -688,8 +3564,12 @@ static int __devinit mcp2515_probe(struct spi_device *spi)
 static int mcp2515_remove(struct spi_device *spi)
 {
     struct net_device *dev = dev_get_drvdata(&spi->dev);
+    struct mcp2515_priv *priv = netdev_priv(dev);
 
+    debugfs_remove_recursive(priv->debug.dir);
     unregister_candev(dev);
+    mcp2515_bus_put(priv);
+    netif_napi_del(&priv->napi);
     dev_set_drvdata(&spi->dev, NULL);
     free_candev(dev);
 
@@ -707,12 +3587,21 @@ static struct spi_driver mcp2515_spi_driver = {
 
 static int __init mcp2515_init(void)
 {
-    return spi_register_driver(&mcp2515_spi_driver);
+    int err;
+
+    mcp2515_debugfs = debugfs_create_dir("mcp2515", NULL);
+
+    err = spi_register_driver(&mcp2515_spi_driver);
+    if (err)
+        debugfs_remove_recursive(mcp2515_debugfs);
+
+    return err;
 }
 module_init(mcp2515_init);
 
 static void __exit mcp2515_exit(void)
 {
     spi_unregister_driver(&mcp2515_spi_driver);
+    debugfs_remove_recursive(mcp2515_debugfs);
 }
 module_exit(mcp2515_exit);
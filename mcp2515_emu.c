@@ -0,0 +1,1166 @@
+/* mcp2515_emu.c: emulator of Microchip MCP2515 SPI CAN controllers
+ *
+ * Copyright 2010 Andre B. Oliveira
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/* This module registers a fake SPI master with emulated MCP2515 chips on
+ * its chip selects, to which the mcp2515 driver binds, for benchmarking
+ * the driver on any Linux machine.
+ *
+ * The SPI master serialises the messages of its chips, taking for each
+ * the time of its bytes at the SPI clock frequency, of its chip select
+ * cycles and of its setup.  A chip runs the instruction set of the
+ * MCP2515 on its registers, at the end of the message.  Its INT pin drives
+ * a virtual interrupt, raised after an interrupt latency, edge or level
+ * triggered as the driver requested it.
+ *
+ * Each chip has its own CAN bus, with the bit time set by its CNF
+ * registers, on which it transmits its frames and a remote node sends
+ * frames at a given rate.  Frames are always acknowledged and there are
+ * no errors.
+ *
+ * Counters of each chip are shown in the stats file of the mcp2515-emu
+ * platform device.*/
+
+/* References: Microchip MCP2515 data sheet, DS21801E, 2007.*/
+
+#include <linux/hrtimer.h>
+#include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/spi/spi.h>
+#include <linux/spinlock.h>
+#include <linux/can.h>
+#include <linux/can/platform/mcp251x.h>
+
+MODULE_DESCRIPTION("Emulator of Microchip MCP2515 SPI CAN controllers");
+MODULE_AUTHOR("Andre B. Oliveira <anbadeol@gmail.com>");
+MODULE_LICENSE("GPL");
+
+/* Maximum number of emulated chips */
+#define CHIPS   4
+
+static unsigned chips = 1;
+module_param(chips, uint, 0444);
+MODULE_PARM_DESC(chips, "Number of emulated chips on the SPI bus (1-4)");
+
+static unsigned oscillator = 16000000;
+module_param(oscillator, uint, 0444);
+MODULE_PARM_DESC(oscillator, "Oscillator frequency of the chips, in Hz");
+
+static unsigned spi_hz = 10000000;
+module_param(spi_hz, uint, 0644);
+MODULE_PARM_DESC(spi_hz, "SPI clock frequency, in Hz");
+
+static unsigned cs_ns = 500;
+module_param(cs_ns, uint, 0644);
+MODULE_PARM_DESC(cs_ns, "Time of each chip select cycle, in ns");
+
+static unsigned msg_ns = 5000;
+module_param(msg_ns, uint, 0644);
+MODULE_PARM_DESC(msg_ns, "Setup time of each SPI message, in ns");
+
+static unsigned irq_ns = 5000;
+module_param(irq_ns, uint, 0644);
+MODULE_PARM_DESC(irq_ns, "Latency from the INT pin to the interrupt, in ns");
+
+static int emu_set_rx_fps(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops emu_rx_fps_ops = {
+    .set = emu_set_rx_fps,
+    .get = param_get_uint,
+};
+
+static unsigned rx_fps;
+module_param_cb(rx_fps, &emu_rx_fps_ops, &rx_fps, 0644);
+MODULE_PARM_DESC(rx_fps, "Frames per second sent by the remote node");
+
+/* A CAN frame on the emulated bus */
+struct emu_frame {
+    u32 id;         /* 11 or 29 bit identifier */
+    u8 ext;         /* extended identifier */
+    u8 rtr;         /* remote transmission request */
+    u8 dlc;
+    u8 data[8];
+};
+
+/* Maximum number of identifiers and data lengths to pick from */
+#define MIX     16
+
+static unsigned rx_ids[MIX] = { 0x123 };
+static unsigned rx_ids_count = 1;
+module_param_array(rx_ids, uint, &rx_ids_count, 0644);
+MODULE_PARM_DESC(rx_ids, "Identifiers of the frames of the remote node, "
+         "picked at random, extended if above 7ff");
+
+static unsigned rx_dlcs[MIX] = { 8 };
+static unsigned rx_dlcs_count = 1;
+module_param_array(rx_dlcs, uint, &rx_dlcs_count, 0644);
+MODULE_PARM_DESC(rx_dlcs, "Data lengths of the frames of the remote node, "
+         "picked at random, repeated for a higher weight");
+
+/* Maximum number of frames to replay */
+#define REPLAY  8192
+
+/* Frames replayed by the remote node, instead of those of rx_ids */
+static DEFINE_SPINLOCK(emu_replay_lock);
+static struct emu_frame emu_replay[REPLAY];
+static unsigned emu_replay_count;
+
+/* Registers */
+#define CANSTAT     0x0e
+#define CANCTRL     0x0f
+#define RXM0        0x20
+#define CNF3        0x28
+#define CNF2        0x29
+#define CNF1        0x2a
+#define CANINTE     0x2b
+#define CANINTF     0x2c
+#define EFLG        0x2d
+#define TXB0CTRL    0x30
+#define RXB0CTRL    0x60
+
+/* CANCTRL bits */
+#define CANCTRL_REQOP   0xe0
+#define CANCTRL_ABAT    0x10
+
+/* Operation modes, in REQOP and OPMOD bits */
+#define MODE_NORMAL     0x00
+#define MODE_LOOPBACK   0x40
+#define MODE_LISTEN     0x60
+#define MODE_CONFIG     0x80
+
+/* TXBnCTRL bits */
+#define TXBCTRL_ABTF    0x40
+#define TXBCTRL_TXREQ   0x08
+#define TXBCTRL_TXP     0x03
+
+/* RXBnCTRL bits */
+#define RXBCTRL_RXM     0x60
+#define RXBCTRL_RXRTR   0x08
+#define RXBCTRL_BUKT    0x04
+
+/* CANINTF bits */
+#define CANINTF_ERRIF   0x20
+#define CANINTF_TX0IF   0x04
+#define CANINTF_RX0IF   0x01
+
+/* EFLG bits */
+#define EFLG_RX1OVR     0x80
+#define EFLG_RX0OVR     0x40
+
+/* Transmit buffers */
+#define TXBS    3
+
+/* Counters of an emulated chip */
+struct emu_stats {
+    u64 spi_messages;   /* SPI messages to the chip */
+    u64 spi_bytes;      /* bytes of those messages */
+    u64 interrupts;     /* interrupts raised */
+    u64 rx_sent;        /* frames sent by the remote node */
+    u64 rx_frames;      /* frames received in a receive buffer */
+    u64 rx_overflows;   /* frames lost with both buffers full */
+    u64 tx_frames;      /* frames transmitted */
+};
+
+/* An emulated MCP2515 */
+struct emu_chip {
+    spinlock_t lock;    /* Lock for the following: */
+    u8 regs[128];       /* register file */
+
+    /* Current chip select cycle */
+    u8 instr;       /* instruction */
+    u8 addr;        /* address of the next register */
+    u8 mask;        /* mask of a BIT MODIFY instruction */
+    unsigned pos;       /* bytes clocked in this cycle */
+    u8 clear_rxif;      /* RXnIF to clear at the end of the cycle */
+
+    /* CAN bus */
+    struct hrtimer bus_timer;
+    struct emu_frame frame; /* frame on the bus */
+    int frame_txb;      /* its transmit buffer, or -1 from remote */
+    u8 bus_busy;        /* a frame is on the bus */
+    ktime_t bus_end;    /* time at the end of that frame */
+    ktime_t rx_next;    /* time of the next frame of the remote node */
+    u32 rx_seq;     /* sequence number in its data */
+    unsigned replay_pos;    /* next frame replayed */
+    struct emu_frame remote;    /* next frame of the remote node */
+    u8 remote_ready;    /* it waits to be sent */
+
+    /* INT pin and interrupt */
+    int irq;
+    struct hrtimer irq_timer;
+    u8 int_pin;     /* INT asserted */
+
+    struct emu_stats stats;
+    struct spi_device *spi;
+};
+
+/* The emulated SPI master */
+struct emu_master {
+    spinlock_t lock;    /* Lock for the following: */
+    struct list_head queue; /* messages waiting */
+    struct spi_message *msg;    /* message being clocked */
+
+    struct hrtimer timer;   /* end of the message being clocked */
+    struct emu_chip chip[CHIPS];
+};
+
+static struct platform_device *emu_pdev;
+static struct spi_master *emu_spi_master;
+static unsigned emu_chips_up;   /* chips set up, with the parameter lock */
+
+/************************************************************************/
+
+/* Return the time of N bits on the bus, from the CNF registers.*/
+static u64 emu_bits_ns(struct emu_chip *c, unsigned n)
+{
+    unsigned brp = c->regs[CNF1] & 0x3f;
+    unsigned tqs = 1 + (c->regs[CNF2] & 7) + 1 +
+        (c->regs[CNF2] >> 3 & 7) + 1 + (c->regs[CNF3] & 7) + 1;
+
+    return div_u64((u64)n * tqs * 2 * (brp + 1) * NSEC_PER_SEC,
+               oscillator);
+}
+
+/* Return the number of bits of a frame, without bit stuffing.*/
+static unsigned emu_frame_bits(const struct emu_frame *f)
+{
+    return (f->ext ? 67 : 47) + (f->rtr ? 0 : 8 * f->dlc);
+}
+
+/* Return the operation mode.*/
+static u8 emu_mode(struct emu_chip *c)
+{
+    return c->regs[CANSTAT] & CANCTRL_REQOP;
+}
+
+/* Update the INT pin, and raise the interrupt on a falling edge, or while
+ * asserted if level triggered.*/
+static void emu_int_pin(struct emu_chip *c)
+{
+    u8 pin = !!(c->regs[CANINTF] & c->regs[CANINTE]);
+    int level = irq_get_trigger_type(c->irq) & IRQ_TYPE_LEVEL_LOW;
+
+    if (pin && (!c->int_pin || level) && !hrtimer_active(&c->irq_timer))
+        hrtimer_start(&c->irq_timer, ns_to_ktime(irq_ns),
+                  HRTIMER_MODE_REL);
+    c->int_pin = pin;
+}
+
+/* Called when the interrupt latency is over.*/
+static enum hrtimer_restart emu_irq_timer(struct hrtimer *timer)
+{
+    struct emu_chip *c = container_of(timer, struct emu_chip, irq_timer);
+
+    c->stats.interrupts++;
+    generic_handle_irq(c->irq);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Enabling or unmasking a level triggered interrupt raises it again if
+ * still asserted; an edge while disabled is resent by the retrigger.*/
+static void emu_irq_unmask(struct irq_data *d)
+{
+    struct emu_chip *c = irq_data_get_irq_chip_data(d);
+
+    if (irqd_get_trigger_type(d) & IRQ_TYPE_LEVEL_LOW && c->int_pin &&
+        !hrtimer_active(&c->irq_timer))
+        hrtimer_start(&c->irq_timer, ns_to_ktime(irq_ns),
+                  HRTIMER_MODE_REL);
+}
+
+static void emu_irq_mask(struct irq_data *d)
+{
+}
+
+static int emu_irq_set_type(struct irq_data *d, unsigned type)
+{
+    return 0;
+}
+
+static int emu_irq_retrigger(struct irq_data *d)
+{
+    struct emu_chip *c = irq_data_get_irq_chip_data(d);
+
+    hrtimer_start(&c->irq_timer, ns_to_ktime(irq_ns), HRTIMER_MODE_REL);
+
+    return 1;
+}
+
+static struct irq_chip emu_irq_chip = {
+    .name = "mcp2515-emu",
+    .irq_enable = emu_irq_unmask,
+    .irq_mask = emu_irq_mask,
+    .irq_unmask = emu_irq_unmask,
+    .irq_set_type = emu_irq_set_type,
+    .irq_retrigger = emu_irq_retrigger,
+};
+
+/************************************************************************/
+
+/* Return whether the filters of receive buffer N accept frame F: the
+ * identifier bits set in the mask equal those of a filter for the same
+ * identifier format; the extended identifier bits are compared with the
+ * first two data bytes of standard frames.*/
+static int emu_accept(struct emu_chip *c, unsigned n, const struct emu_frame *f)
+{
+    static const u8 filters[6] = { 0x00, 0x04, 0x08, 0x10, 0x14, 0x18 };
+    u8 *m = c->regs + RXM0 + 4 * n;
+    u32 sid, eid, msid, meid, fsid, feid;
+    unsigned i;
+    u8 *r;
+
+    if ((c->regs[RXB0CTRL + 0x10 * n] & RXBCTRL_RXM) == RXBCTRL_RXM)
+        return 1;
+
+    if (f->ext) {
+        sid = f->id >> 18;
+        eid = f->id & 0x3ffff;
+    } else {
+        sid = f->id;
+        eid = (f->dlc > 0 ? f->data[0] << 8 : 0) |
+            (f->dlc > 1 ? f->data[1] : 0);
+    }
+
+    msid = m[0] << 3 | m[1] >> 5;
+    meid = (m[1] & 3) << 16 | m[2] << 8 | m[3];
+    if (!f->ext)
+        meid &= 0xffff;
+
+    for (i = n ? 2 : 0; i < (n ? 6 : 2); i++) {
+        r = c->regs + filters[i];
+        if (!!(r[1] & 8) != f->ext)
+            continue;
+        fsid = r[0] << 3 | r[1] >> 5;
+        feid = (r[1] & 3) << 16 | r[2] << 8 | r[3];
+        if (!((sid ^ fsid) & msid) && !((eid ^ feid) & meid))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Write frame F to receive buffer N and flag it.*/
+static void emu_load_rxb(struct emu_chip *c, unsigned n,
+             const struct emu_frame *f)
+{
+    u8 *r = c->regs + RXB0CTRL + 0x10 * n;
+
+    r[0] &= ~RXBCTRL_RXRTR;
+    if (f->ext) {
+        r[1] = f->id >> 21;
+        r[2] = (f->id >> 13 & 0xe0) | 8 | (f->id >> 16 & 3);
+        r[3] = f->id >> 8;
+        r[4] = f->id;
+        r[5] = (f->rtr ? 0x40 : 0) | f->dlc;
+    } else {
+        r[1] = f->id >> 3;
+        r[2] = f->id << 5 | (f->rtr ? 0x10 : 0);
+        r[3] = 0;
+        r[4] = 0;
+        r[5] = f->dlc;
+        if (f->rtr)
+            r[0] |= RXBCTRL_RXRTR;
+    }
+    memcpy(r + 6, f->data, 8);
+
+    c->regs[CANINTF] |= CANINTF_RX0IF << n;
+    c->stats.rx_frames++;
+}
+
+/* Receive frame F: in RXB0 if its filters accept it, or in RXB1 if RXB0
+ * is full and rollover is enabled, else in RXB1 if its filters accept it.
+ * As the controller does, a frame lost for RXB0 sets RX0OVR even with
+ * rollover (see the note in the driver).*/
+static void emu_receive(struct emu_chip *c, const struct emu_frame *f)
+{
+    if (emu_accept(c, 0, f)) {
+        if (!(c->regs[CANINTF] & CANINTF_RX0IF))
+            emu_load_rxb(c, 0, f);
+        else if (c->regs[RXB0CTRL] & RXBCTRL_BUKT &&
+             !(c->regs[CANINTF] & CANINTF_RX0IF << 1))
+            emu_load_rxb(c, 1, f);
+        else {
+            c->regs[EFLG] |= EFLG_RX0OVR;
+            c->regs[CANINTF] |= CANINTF_ERRIF;
+            c->stats.rx_overflows++;
+        }
+    } else if (emu_accept(c, 1, f)) {
+        if (!(c->regs[CANINTF] & CANINTF_RX0IF << 1))
+            emu_load_rxb(c, 1, f);
+        else {
+            c->regs[EFLG] |= EFLG_RX1OVR;
+            c->regs[CANINTF] |= CANINTF_ERRIF;
+            c->stats.rx_overflows++;
+        }
+    }
+}
+
+/* Return the transmit buffer to send next, of highest TXP priority and
+ * then buffer number, or -1 if none requests to send.*/
+static int emu_tx_pick(struct emu_chip *c)
+{
+    int best = -1;
+    u8 ctrl;
+    int n;
+
+    for (n = 0; n < TXBS; n++) {
+        ctrl = c->regs[TXB0CTRL + 0x10 * n];
+        if (!(ctrl & TXBCTRL_TXREQ))
+            continue;
+        if (best < 0 || (ctrl & TXBCTRL_TXP) >=
+            (c->regs[TXB0CTRL + 0x10 * best] & TXBCTRL_TXP))
+            best = n;
+    }
+
+    return best;
+}
+
+/* Set frame F from transmit buffer N.*/
+static void emu_read_txb(struct emu_chip *c, unsigned n, struct emu_frame *f)
+{
+    u8 *r = c->regs + TXB0CTRL + 0x10 * n;
+
+    f->ext = !!(r[2] & 8);
+    if (f->ext)
+        f->id = r[1] << 21 | (r[2] & 0xe0) << 13 | (r[2] & 3) << 16 |
+            r[3] << 8 | r[4];
+    else
+        f->id = r[1] << 3 | r[2] >> 5;
+    f->rtr = !!(r[5] & 0x40);
+    f->dlc = min(r[5] & 0x0f, 8);
+    memcpy(f->data, r + 6, 8);
+}
+
+/* Set the next frame of the remote node: the next one replayed, or else
+ * one of the identifiers and data lengths given, with a sequence number in
+ * the data.*/
+static void emu_remote_frame(struct emu_chip *c, struct emu_frame *f)
+{
+    unsigned ids = min_t(unsigned, rx_ids_count, MIX);
+    unsigned dlcs = min_t(unsigned, rx_dlcs_count, MIX);
+    u32 id;
+
+    spin_lock(&emu_replay_lock);
+    if (emu_replay_count) {
+        *f = emu_replay[c->replay_pos++ % emu_replay_count];
+        spin_unlock(&emu_replay_lock);
+        return;
+    }
+    spin_unlock(&emu_replay_lock);
+
+    id = ids ? rx_ids[ids > 1 ? prandom_u32() % ids : 0] : 0;
+    f->ext = id > CAN_SFF_MASK;
+    f->id = id & (f->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+    f->rtr = 0;
+    f->dlc = min(dlcs ? rx_dlcs[dlcs > 1 ? prandom_u32() % dlcs : 0] : 0,
+             8u);
+    memset(f->data, 0, 8);
+    memcpy(f->data, &c->rx_seq, min_t(unsigned, f->dlc, 4));
+    c->rx_seq++;
+}
+
+/* Put the next frame on the bus if it is idle: the one of the transmit
+ * buffers or the remote node that wins the arbitration, at the time it
+ * is ready.*/
+static void emu_bus_run(struct emu_chip *c)
+{
+    u8 mode = emu_mode(c);
+    ktime_t now = ktime_get();
+    u64 period = rx_fps ? div_u64(NSEC_PER_SEC, rx_fps) : 0;
+    struct emu_frame *remote = &c->remote;
+    int txb = -1;
+
+    if (c->bus_busy)
+        return;
+
+    if (mode == MODE_NORMAL || mode == MODE_LOOPBACK)
+        txb = emu_tx_pick(c);
+
+    if (period && (mode == MODE_NORMAL || mode == MODE_LISTEN)) {
+        /* A remote node that was kept off the bus does not burst. */
+        if (ktime_before(ktime_add_ns(c->rx_next, 16 * period), now))
+            c->rx_next = now;
+        if (!c->remote_ready && !ktime_after(c->rx_next, now)) {
+            emu_remote_frame(c, remote);
+            c->remote_ready = 1;
+        }
+    } else {
+        c->remote_ready = 0;
+    }
+
+    if (txb >= 0) {
+        emu_read_txb(c, txb, &c->frame);
+        if (c->remote_ready && mode != MODE_LOOPBACK &&
+            remote->id << (remote->ext ? 0 : 18) <
+            c->frame.id << (c->frame.ext ? 0 : 18))
+            txb = -1;
+    }
+
+    if (txb < 0 && c->remote_ready) {
+        c->frame = *remote;
+        c->remote_ready = 0;
+        c->rx_next = ktime_add_ns(c->rx_next, period);
+        c->stats.rx_sent++;
+    } else if (txb < 0) {
+        if (period && (mode == MODE_NORMAL || mode == MODE_LISTEN))
+            hrtimer_start(&c->bus_timer, c->rx_next, HRTIMER_MODE_ABS);
+        return;
+    }
+
+    c->frame_txb = txb;
+    c->bus_busy = 1;
+    c->bus_end = ktime_add_ns(now,
+                  emu_bits_ns(c, emu_frame_bits(&c->frame)));
+    hrtimer_start(&c->bus_timer, c->bus_end, HRTIMER_MODE_ABS);
+}
+
+/* Called at the end of the frame on the bus, or when the remote node has
+ * its next frame ready.*/
+static enum hrtimer_restart emu_bus_timer(struct hrtimer *timer)
+{
+    struct emu_chip *c = container_of(timer, struct emu_chip, bus_timer);
+    unsigned long flags;
+    int n;
+
+    spin_lock_irqsave(&c->lock, flags);
+
+    /* The timer was restarted for a frame put on the bus meanwhile. */
+    if (c->bus_busy && ktime_before(ktime_get(), c->bus_end)) {
+        spin_unlock_irqrestore(&c->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+
+    if (c->bus_busy && emu_mode(c) != MODE_CONFIG) {
+        n = c->frame_txb;
+        if (n >= 0) {
+            c->regs[TXB0CTRL + 0x10 * n] &= ~TXBCTRL_TXREQ;
+            c->regs[CANINTF] |= CANINTF_TX0IF << n;
+            c->stats.tx_frames++;
+            if (emu_mode(c) == MODE_LOOPBACK)
+                emu_receive(c, &c->frame);
+        } else {
+            emu_receive(c, &c->frame);
+        }
+        emu_int_pin(c);
+    }
+    c->bus_busy = 0;
+
+    emu_bus_run(c);
+
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Set the rate of the remote node, and put its next frame on the bus of
+ * each chip at that rate: with no bus timer armed while the rate was 0,
+ * nothing else would.*/
+static int emu_set_rx_fps(const char *val, const struct kernel_param *kp)
+{
+    struct emu_master *em;
+    struct emu_chip *c;
+    unsigned long flags;
+    unsigned i;
+    int err;
+
+    err = param_set_uint(val, kp);
+    if (err || !emu_chips_up)
+        return err;
+
+    em = spi_master_get_devdata(emu_spi_master);
+    for (i = 0; i < emu_chips_up; i++) {
+        c = &em->chip[i];
+        spin_lock_irqsave(&c->lock, flags);
+        emu_bus_run(c);
+        spin_unlock_irqrestore(&c->lock, flags);
+    }
+
+    return 0;
+}
+
+/************************************************************************/
+
+/* Reset the registers to their reset values, in configuration mode.*/
+static void emu_reset(struct emu_chip *c)
+{
+    memset(c->regs, 0, sizeof(c->regs));
+    c->regs[CANCTRL] = 0x87;
+    c->regs[CANSTAT] = MODE_CONFIG;
+    c->int_pin = 0;
+}
+
+/* Read the register at address ADDR.  CANSTAT and CANCTRL are at the end
+ * of every row of the register map.*/
+static u8 emu_read(struct emu_chip *c, u8 addr)
+{
+    addr &= 0x7f;
+    if ((addr & 0x0f) == 0x0e)
+        return c->regs[CANSTAT];
+    if ((addr & 0x0f) == 0x0f)
+        return c->regs[CANCTRL];
+    return c->regs[addr];
+}
+
+/* Write VALUE to the register at address ADDR, with the side effects of
+ * the control registers.*/
+static void emu_write(struct emu_chip *c, u8 addr, u8 value)
+{
+    int n;
+
+    addr &= 0x7f;
+    switch (addr & 0x0f) {
+    case 0x0e:
+        return;     /* CANSTAT is read-only */
+    case 0x0f:
+        c->regs[CANCTRL] = value;
+        c->regs[CANSTAT] = value & CANCTRL_REQOP;
+        if (value & CANCTRL_ABAT) {
+            for (n = 0; n < TXBS; n++) {
+                u8 *ctrl = c->regs + TXB0CTRL + 0x10 * n;
+
+                if (*ctrl & TXBCTRL_TXREQ && (c->frame_txb != n ||
+                                  !c->bus_busy))
+                    *ctrl = (*ctrl & ~TXBCTRL_TXREQ) |
+                        TXBCTRL_ABTF;
+            }
+        }
+        emu_bus_run(c);
+        return;
+    }
+
+    switch (addr) {
+    case 0x1c:      /* TEC */
+    case 0x1d:      /* REC */
+        return;
+    case EFLG:
+        c->regs[EFLG] &= value | ~(EFLG_RX0OVR | EFLG_RX1OVR);
+        return;
+    case TXB0CTRL:
+    case TXB0CTRL + 0x10:
+    case TXB0CTRL + 0x20:
+        c->regs[addr] = (c->regs[addr] & ~(TXBCTRL_TXREQ | TXBCTRL_TXP)) |
+            (value & (TXBCTRL_TXREQ | TXBCTRL_TXP));
+        if (value & TXBCTRL_TXREQ)
+            c->regs[addr] &= ~TXBCTRL_ABTF;
+        emu_bus_run(c);
+        return;
+    }
+
+    c->regs[addr] = value;
+}
+
+/* Return the result of the READ STATUS instruction.*/
+static u8 emu_status(struct emu_chip *c)
+{
+    u8 canintf = c->regs[CANINTF];
+    u8 status = canintf & 3;
+    int n;
+
+    for (n = 0; n < TXBS; n++) {
+        if (c->regs[TXB0CTRL + 0x10 * n] & TXBCTRL_TXREQ)
+            status |= 0x04 << 2 * n;
+        if (canintf & CANINTF_TX0IF << n)
+            status |= 0x08 << 2 * n;
+    }
+
+    return status;
+}
+
+/* Return the result of the RX STATUS instruction.*/
+static u8 emu_rx_status(struct emu_chip *c)
+{
+    u8 full = c->regs[CANINTF] & 3;
+    u8 *r = c->regs + RXB0CTRL + (full == 2 ? 0x10 : 0);
+    u8 status = full << 6;
+
+    if (!full)
+        return 0;
+    if (r[2] & 8)
+        status |= 0x10 | (r[5] & 0x40 ? 0x08 : 0);
+    else if (r[0] & RXBCTRL_RXRTR)
+        status |= 0x08;
+
+    return status;
+}
+
+/* Clock byte IN of the current chip select cycle, returning the byte
+ * clocked out.*/
+static u8 emu_byte(struct emu_chip *c, u8 in)
+{
+    unsigned pos = c->pos++;
+    u8 out = 0;
+    int n;
+
+    if (pos == 0) {
+        c->instr = in;
+        if (in == 0xc0) {   /* reset */
+            emu_reset(c);
+        } else if ((in & 0xf9) == 0x90) {   /* read rx buffer */
+            n = in >> 2 & 1;
+            c->addr = RXB0CTRL + 0x10 * n + 1 + (in & 2 ? 5 : 0);
+            c->clear_rxif |= CANINTF_RX0IF << n;
+        } else if ((in & 0xf8) == 0x40 && (in & 7) < 6) { /* load tx */
+            c->addr = TXB0CTRL + 0x10 * ((in & 7) >> 1) + 1 +
+                (in & 1 ? 5 : 0);
+        } else if ((in & 0xf8) == 0x80) {   /* request to send */
+            for (n = 0; n < TXBS; n++)
+                if (in & 1 << n)
+                    emu_write(c, TXB0CTRL + 0x10 * n,
+                          c->regs[TXB0CTRL + 0x10 * n] |
+                          TXBCTRL_TXREQ);
+        }
+        return 0;
+    }
+
+    switch (c->instr) {
+    case 0x03:      /* read */
+        if (pos == 1)
+            c->addr = in;
+        else
+            out = emu_read(c, c->addr++);
+        break;
+    case 0x02:      /* write */
+        if (pos == 1)
+            c->addr = in;
+        else
+            emu_write(c, c->addr++, in);
+        break;
+    case 0x05:      /* bit modify */
+        if (pos == 1)
+            c->addr = in;
+        else if (pos == 2)
+            c->mask = in;
+        else if (pos == 3)
+            emu_write(c, c->addr, (emu_read(c, c->addr) & ~c->mask) |
+                  (in & c->mask));
+        break;
+    case 0xa0:      /* read status */
+        out = emu_status(c);
+        break;
+    case 0xb0:      /* rx status */
+        out = emu_rx_status(c);
+        break;
+    default:
+        if ((c->instr & 0xf9) == 0x90)
+            out = c->regs[c->addr++ & 0x7f];
+        else if ((c->instr & 0xf8) == 0x40 && (c->instr & 7) < 6)
+            c->regs[c->addr++ & 0x7f] = in;
+        break;
+    }
+
+    return out;
+}
+
+/* End the current chip select cycle.*/
+static void emu_cs_end(struct emu_chip *c)
+{
+    c->regs[CANINTF] &= ~c->clear_rxif;
+    c->clear_rxif = 0;
+    c->pos = 0;
+    emu_int_pin(c);
+}
+
+/* Run the transfers of message M on its chip.*/
+static void emu_run_message(struct emu_chip *c, struct spi_message *m)
+{
+    struct spi_transfer *t;
+    const u8 *tx;
+    u8 *rx;
+    unsigned long flags;
+    unsigned i;
+    u8 out;
+
+    spin_lock_irqsave(&c->lock, flags);
+
+    list_for_each_entry(t, &m->transfers, transfer_list) {
+        tx = t->tx_buf;
+        rx = t->rx_buf;
+        for (i = 0; i < t->len; i++) {
+            out = emu_byte(c, tx ? tx[i] : 0);
+            if (rx)
+                rx[i] = out;
+        }
+        m->actual_length += t->len;
+        c->stats.spi_bytes += t->len;
+        if (t->cs_change || list_is_last(&t->transfer_list,
+                         &m->transfers))
+            emu_cs_end(c);
+    }
+    c->stats.spi_messages++;
+
+    spin_unlock_irqrestore(&c->lock, flags);
+}
+
+/* Return the time taken by message M on the SPI bus.*/
+static u64 emu_message_ns(struct spi_message *m)
+{
+    struct spi_transfer *t;
+    u64 bytes = 0;
+    unsigned cycles = 0;
+
+    list_for_each_entry(t, &m->transfers, transfer_list) {
+        bytes += t->len;
+        if (t->cs_change || list_is_last(&t->transfer_list,
+                         &m->transfers))
+            cycles++;
+    }
+
+    return div_u64(bytes * 8 * NSEC_PER_SEC, spi_hz) +
+        (u64)cycles * cs_ns + msg_ns;
+}
+
+/* Start clocking the next message waiting, if the bus is free.*/
+static void emu_spi_next(struct emu_master *em)
+{
+    if (em->msg || list_empty(&em->queue))
+        return;
+
+    em->msg = list_first_entry(&em->queue, struct spi_message, queue);
+    list_del_init(&em->msg->queue);
+    hrtimer_start(&em->timer, ns_to_ktime(emu_message_ns(em->msg)),
+              HRTIMER_MODE_REL);
+}
+
+/* Called at the end of the message being clocked: the chip runs it, then
+ * it completes, and the next message starts.*/
+static enum hrtimer_restart emu_spi_timer(struct hrtimer *timer)
+{
+    struct emu_master *em = container_of(timer, struct emu_master, timer);
+    struct spi_message *m = em->msg;
+    unsigned long flags;
+
+    emu_run_message(&em->chip[m->spi->chip_select], m);
+    m->status = 0;
+
+    spin_lock_irqsave(&em->lock, flags);
+    em->msg = NULL;
+    emu_spi_next(em);
+    spin_unlock_irqrestore(&em->lock, flags);
+
+    m->complete(m->context);
+
+    return HRTIMER_NORESTART;
+}
+
+static int emu_transfer(struct spi_device *spi, struct spi_message *m)
+{
+    struct emu_master *em = spi_master_get_devdata(spi->master);
+    unsigned long flags;
+
+    m->actual_length = 0;
+    m->status = -EINPROGRESS;
+
+    spin_lock_irqsave(&em->lock, flags);
+    list_add_tail(&m->queue, &em->queue);
+    emu_spi_next(em);
+    spin_unlock_irqrestore(&em->lock, flags);
+
+    return 0;
+}
+
+static int emu_setup(struct spi_device *spi)
+{
+    return 0;
+}
+
+/************************************************************************/
+
+/* Show the counters of each chip.*/
+static ssize_t emu_show_stats(struct device *d, struct device_attribute *attr,
+                  char *buf)
+{
+    struct emu_master *em = spi_master_get_devdata(emu_spi_master);
+    ssize_t len = 0;
+    unsigned i;
+
+    for (i = 0; i < chips; i++) {
+        struct emu_stats *s = &em->chip[i].stats;
+
+        len += sprintf(buf + len, "chip%u spi_messages %llu "
+                   "spi_bytes %llu interrupts %llu rx_sent %llu "
+                   "rx_frames %llu rx_overflows %llu "
+                   "tx_frames %llu\n", i, s->spi_messages,
+                   s->spi_bytes, s->interrupts, s->rx_sent,
+                   s->rx_frames, s->rx_overflows, s->tx_frames);
+    }
+
+    return len;
+}
+
+/* Clear the counters of each chip.*/
+static ssize_t emu_store_stats(struct device *d, struct device_attribute *attr,
+                   const char *buf, size_t count)
+{
+    struct emu_master *em = spi_master_get_devdata(emu_spi_master);
+    unsigned long flags;
+    unsigned i;
+
+    for (i = 0; i < chips; i++) {
+        spin_lock_irqsave(&em->chip[i].lock, flags);
+        memset(&em->chip[i].stats, 0, sizeof(em->chip[i].stats));
+        spin_unlock_irqrestore(&em->chip[i].lock, flags);
+    }
+
+    return count;
+}
+
+static DEVICE_ATTR(stats, S_IRUGO | S_IWUSR, emu_show_stats, emu_store_stats);
+
+/* Show the number of frames replayed.*/
+static ssize_t emu_show_replay(struct device *d, struct device_attribute *attr,
+                   char *buf)
+{
+    return sprintf(buf, "%u\n", emu_replay_count);
+}
+
+/* Parse the frame in the candump log line LINE, as its last field
+ * "<id>#<data>" or "<id>#R", into F.  An identifier of 8 digits, or above
+ * 7ff, is extended.  Return 0, or -EINVAL if the line has no such frame.*/
+static int emu_parse_frame(char *line, struct emu_frame *f)
+{
+    char *field = strrchr(line, ' ');
+    char *hash;
+    unsigned long id;
+    unsigned i;
+    int hi, lo;
+
+    field = field ? field + 1 : line;
+    hash = strchr(field, '#');
+    if (!hash || hash[1] == '#')    /* not a CAN FD frame */
+        return -EINVAL;
+    *hash++ = '\0';
+    if (kstrtoul(field, 16, &id))
+        return -EINVAL;
+
+    f->ext = strlen(field) == 8 || id > CAN_SFF_MASK;
+    f->id = id & (f->ext ? CAN_EFF_MASK : CAN_SFF_MASK);
+    f->rtr = *hash == 'R';
+    f->dlc = 0;
+    memset(f->data, 0, 8);
+    if (f->rtr)
+        return 0;
+
+    for (i = 0; hash[0] && hash[1] && i < 8; i++, hash += 2) {
+        hi = hex_to_bin(hash[0]);
+        lo = hex_to_bin(hash[1]);
+        if (hi < 0 || lo < 0)
+            return -EINVAL;
+        f->data[i] = hi << 4 | lo;
+    }
+    f->dlc = i;
+
+    return 0;
+}
+
+/* Add the frames of the lines of a candump log ("candump -l", or the
+ * output of "candump -L") to those the remote node replays, in order,
+ * at rx_fps frames per second.  Writing an empty line clears them.*/
+static ssize_t emu_store_replay(struct device *d, struct device_attribute *attr,
+                const char *buf, size_t count)
+{
+    struct emu_frame f;
+    char *copy, *p, *line;
+    unsigned long flags;
+    int err = 0;
+
+    if (count == 0 || (count == 1 && buf[0] == '\n')) {
+        spin_lock_irqsave(&emu_replay_lock, flags);
+        emu_replay_count = 0;
+        spin_unlock_irqrestore(&emu_replay_lock, flags);
+        return count;
+    }
+
+    copy = kstrndup(buf, count, GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+
+    p = copy;
+    while ((line = strsep(&p, "\n"))) {
+        line = strim(line);
+        if (!*line)
+            continue;
+        err = emu_parse_frame(line, &f);
+        if (err)
+            break;
+        spin_lock_irqsave(&emu_replay_lock, flags);
+        if (emu_replay_count < REPLAY)
+            emu_replay[emu_replay_count++] = f;
+        else
+            err = -ENOSPC;
+        spin_unlock_irqrestore(&emu_replay_lock, flags);
+        if (err)
+            break;
+    }
+
+    kfree(copy);
+
+    return err ? err : count;
+}
+
+static DEVICE_ATTR(replay, S_IRUGO | S_IWUSR, emu_show_replay,
+           emu_store_replay);
+
+static struct mcp251x_platform_data emu_pdata;
+
+/* Set up chip N: its registers, timers and interrupt, and its device on
+ * the SPI master.*/
+static int emu_chip_init(struct emu_master *em, unsigned n)
+{
+    struct emu_chip *c = &em->chip[n];
+    struct spi_board_info info = {
+        .modalias = "mcp2515",
+        .platform_data = &emu_pdata,
+        .max_speed_hz = spi_hz,
+        .chip_select = n,
+    };
+
+    spin_lock_init(&c->lock);
+    emu_reset(c);
+    hrtimer_init(&c->bus_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    c->bus_timer.function = emu_bus_timer;
+    hrtimer_init(&c->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    c->irq_timer.function = emu_irq_timer;
+    c->rx_next = ktime_get();
+
+    c->irq = irq_alloc_desc(NUMA_NO_NODE);
+    if (c->irq < 0)
+        return c->irq;
+    irq_set_chip_and_handler(c->irq, &emu_irq_chip, handle_simple_irq);
+    irq_set_chip_data(c->irq, c);
+    irq_modify_status(c->irq, IRQ_NOREQUEST | IRQ_NOAUTOEN, IRQ_NOPROBE);
+
+    info.irq = c->irq;
+    c->spi = spi_new_device(emu_spi_master, &info);
+    if (!c->spi) {
+        irq_free_desc(c->irq);
+        c->irq = -1;
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+/* Remove chip N.*/
+static void emu_chip_exit(struct emu_master *em, unsigned n)
+{
+    struct emu_chip *c = &em->chip[n];
+
+    if (c->spi)
+        spi_unregister_device(c->spi);
+    hrtimer_cancel(&c->bus_timer);
+    hrtimer_cancel(&c->irq_timer);
+    if (c->irq >= 0)
+        irq_free_desc(c->irq);
+}
+
+static int __init emu_init(void)
+{
+    struct spi_master *master;
+    struct emu_master *em;
+    unsigned i;
+    int err;
+
+    if (!chips || chips > CHIPS || !spi_hz || !oscillator)
+        return -EINVAL;
+
+    emu_pdata.oscillator_frequency = oscillator;
+
+    emu_pdev = platform_device_register_simple("mcp2515-emu", -1, NULL, 0);
+    if (IS_ERR(emu_pdev))
+        return PTR_ERR(emu_pdev);
+
+    master = spi_alloc_master(&emu_pdev->dev, sizeof(*em));
+    if (!master) {
+        err = -ENOMEM;
+        goto err1;
+    }
+
+    master->bus_num = -1;
+    master->num_chipselect = chips;
+    master->mode_bits = SPI_CPOL | SPI_CPHA;
+    master->setup = emu_setup;
+    master->transfer = emu_transfer;
+
+    em = spi_master_get_devdata(master);
+    spin_lock_init(&em->lock);
+    INIT_LIST_HEAD(&em->queue);
+    hrtimer_init(&em->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    em->timer.function = emu_spi_timer;
+    for (i = 0; i < CHIPS; i++)
+        em->chip[i].irq = -1;
+
+    err = spi_register_master(master);
+    if (err) {
+        spi_master_put(master);
+        goto err1;
+    }
+    emu_spi_master = master;
+
+    for (i = 0; i < chips; i++) {
+        err = emu_chip_init(em, i);
+        if (err)
+            goto err2;
+    }
+    kernel_param_lock(THIS_MODULE);
+    emu_chips_up = chips;
+    kernel_param_unlock(THIS_MODULE);
+
+    err = device_create_file(&emu_pdev->dev, &dev_attr_stats);
+    if (err)
+        goto err2;
+    err = device_create_file(&emu_pdev->dev, &dev_attr_replay);
+    if (err) {
+        device_remove_file(&emu_pdev->dev, &dev_attr_stats);
+        goto err2;
+    }
+
+    return 0;
+
+err2:   kernel_param_lock(THIS_MODULE);
+    emu_chips_up = 0;
+    kernel_param_unlock(THIS_MODULE);
+    while (i--)
+        emu_chip_exit(em, i);
+    spi_unregister_master(master);
+err1:   platform_device_unregister(emu_pdev);
+    return err;
+}
+module_init(emu_init);
+
+static void __exit emu_exit(void)
+{
+    struct emu_master *em = spi_master_get_devdata(emu_spi_master);
+    unsigned i;
+
+    device_remove_file(&emu_pdev->dev, &dev_attr_replay);
+    device_remove_file(&emu_pdev->dev, &dev_attr_stats);
+    kernel_param_lock(THIS_MODULE);
+    emu_chips_up = 0;
+    kernel_param_unlock(THIS_MODULE);
+    for (i = 0; i < chips; i++)
+        emu_chip_exit(em, i);
+    hrtimer_cancel(&em->timer);
+    spi_unregister_master(emu_spi_master);
+    platform_device_unregister(emu_pdev);
+}
+module_exit(emu_exit);
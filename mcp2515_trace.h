@@ -0,0 +1,236 @@
+/* mcp2515_trace.h: tracepoints of the mcp2515 driver
+ *
+ * Copyright 2010 Andre B. Oliveira
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/* Events of the SPI message chain, in /sys/kernel/debug/tracing/events/
+ * mcp2515/.  Every event has the interface index and name, the STATE_
+ * bits of the chain, and "now", the time of the event in ns of the
+ * realtime clock, as the timestamps of the frames, "stamp", so that
+ * now - stamp of an mcp2515_rx event is the time from the interrupt to
+ * passing up the frame.  All fields have a fixed size, for bpftrace and
+ * perf script.*/
+
+#ifndef MCP2515_TRACE_STAGES
+#define MCP2515_TRACE_STAGES
+
+/* Steps of the chain, each an SPI message */
+#define STAGE_READ_FLAGS    0   /* read the interrupt flags */
+#define STAGE_READ_SPEC     1   /* read status and RXB0 */
+#define STAGE_READ_RXB      2   /* read a receive buffer */
+#define STAGE_READ_RXB_HEAD 3   /* read a receive buffer header */
+#define STAGE_CLEAR_CANINTF 4   /* clear the interrupt flags */
+#define STAGE_CLEAR_EFLG    5   /* clear the overflow flags */
+#define STAGE_LOAD_TXB      6   /* load and send a transmit buffer */
+#define STAGES              7
+
+#define show_stage(stage) __print_symbolic(stage,           \
+    { STAGE_READ_FLAGS,     "read_flags" },             \
+    { STAGE_READ_SPEC,      "read_spec" },              \
+    { STAGE_READ_RXB,       "read_rxb" },               \
+    { STAGE_READ_RXB_HEAD,  "read_rxb_head" },          \
+    { STAGE_CLEAR_CANINTF,  "clear_canintf" },          \
+    { STAGE_CLEAR_EFLG,     "clear_eflg" },             \
+    { STAGE_LOAD_TXB,       "load_txb" })
+
+#endif
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mcp2515
+
+#if !defined(_MCP2515_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MCP2515_TRACE_H
+
+#include <linux/if.h>
+#include <linux/ktime.h>
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+
+#define MCP2515_TP_DEV                          \
+    __field(int, ifindex)                       \
+    __array(char, name, IFNAMSIZ)                   \
+    __field(u8, state)                      \
+    __field(s64, now)
+
+#define MCP2515_TP_DEV_ASSIGN(dev, st)                  \
+    __entry->ifindex = (dev)->ifindex;              \
+    memcpy(__entry->name, (dev)->name, IFNAMSIZ);           \
+    __entry->state = (st);                      \
+    __entry->now = ktime_to_ns(ktime_get_real());
+
+/* An interrupt, with its timestamp */
+TRACE_EVENT(mcp2515_interrupt,
+    TP_PROTO(struct net_device *dev, int state, ktime_t stamp),
+    TP_ARGS(dev, state, stamp),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(s64, stamp)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->stamp = ktime_to_ns(stamp);
+    ),
+    TP_printk("%s state=%#x stamp=%lld", __entry->name, __entry->state,
+          __entry->stamp)
+);
+
+/* A step of the chain, with the flags last read */
+DECLARE_EVENT_CLASS(mcp2515_stage,
+    TP_PROTO(struct net_device *dev, int state, int stage, u8 canintf,
+         u8 eflg, unsigned bytes),
+    TP_ARGS(dev, state, stage, canintf, eflg, bytes),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(u8, stage)
+        __field(u8, canintf)
+        __field(u8, eflg)
+        __field(u16, bytes)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->stage = stage;
+        __entry->canintf = canintf;
+        __entry->eflg = eflg;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("%s state=%#x %s canintf=%#04x eflg=%#04x bytes=%u",
+          __entry->name, __entry->state, show_stage(__entry->stage),
+          __entry->canintf, __entry->eflg, __entry->bytes)
+);
+
+/* The SPI message of a step submitted */
+DEFINE_EVENT(mcp2515_stage, mcp2515_submit,
+    TP_PROTO(struct net_device *dev, int state, int stage, u8 canintf,
+         u8 eflg, unsigned bytes),
+    TP_ARGS(dev, state, stage, canintf, eflg, bytes)
+);
+
+/* The SPI message of a step completed */
+DEFINE_EVENT(mcp2515_stage, mcp2515_complete,
+    TP_PROTO(struct net_device *dev, int state, int stage, u8 canintf,
+         u8 eflg, unsigned bytes),
+    TP_ARGS(dev, state, stage, canintf, eflg, bytes)
+);
+
+/* The interrupt flags read, from READ STATUS or the registers */
+TRACE_EVENT(mcp2515_flags,
+    TP_PROTO(struct net_device *dev, int state, u8 canintf, u8 eflg,
+         int status_read),
+    TP_ARGS(dev, state, canintf, eflg, status_read),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(u8, canintf)
+        __field(u8, eflg)
+        __field(u8, status_read)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->canintf = canintf;
+        __entry->eflg = eflg;
+        __entry->status_read = status_read;
+    ),
+    TP_printk("%s state=%#x canintf=%#04x eflg=%#04x%s", __entry->name,
+          __entry->state, __entry->canintf, __entry->eflg,
+          __entry->status_read ? " status" : "")
+);
+
+/* The chain gone idle */
+TRACE_EVENT(mcp2515_idle,
+    TP_PROTO(struct net_device *dev, int state),
+    TP_ARGS(dev, state),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+    ),
+    TP_printk("%s state=%#x", __entry->name, __entry->state)
+);
+
+/* A frame of a receive buffer passed up, with its timestamp */
+TRACE_EVENT(mcp2515_rx,
+    TP_PROTO(struct net_device *dev, int state, unsigned rxb, u32 can_id,
+         u8 dlc, ktime_t stamp),
+    TP_ARGS(dev, state, rxb, can_id, dlc, stamp),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(u32, can_id)
+        __field(u8, rxb)
+        __field(u8, dlc)
+        __field(s64, stamp)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->can_id = can_id;
+        __entry->rxb = rxb;
+        __entry->dlc = dlc;
+        __entry->stamp = ktime_to_ns(stamp);
+    ),
+    TP_printk("%s state=%#x rxb%u id=%#x dlc=%u stamp=%lld",
+          __entry->name, __entry->state, __entry->rxb, __entry->can_id,
+          __entry->dlc, __entry->stamp)
+);
+
+/* A frame handed to the driver on transmit queue QUEUE */
+TRACE_EVENT(mcp2515_xmit,
+    TP_PROTO(struct net_device *dev, int state, unsigned queue,
+         u32 can_id, u8 dlc),
+    TP_ARGS(dev, state, queue, can_id, dlc),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(u32, can_id)
+        __field(u8, queue)
+        __field(u8, dlc)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->can_id = can_id;
+        __entry->queue = queue;
+        __entry->dlc = dlc;
+    ),
+    TP_printk("%s state=%#x queue=%u id=%#x dlc=%u", __entry->name,
+          __entry->state, __entry->queue, __entry->can_id, __entry->dlc)
+);
+
+/* The transmission of a frame from buffer TXB completed, with the
+ * timestamp of its completion */
+TRACE_EVENT(mcp2515_tx_done,
+    TP_PROTO(struct net_device *dev, int state, unsigned txb, u32 can_id,
+         ktime_t stamp),
+    TP_ARGS(dev, state, txb, can_id, stamp),
+    TP_STRUCT__entry(
+        MCP2515_TP_DEV
+        __field(u32, can_id)
+        __field(u8, txb)
+        __field(s64, stamp)
+    ),
+    TP_fast_assign(
+        MCP2515_TP_DEV_ASSIGN(dev, state)
+        __entry->can_id = can_id;
+        __entry->txb = txb;
+        __entry->stamp = ktime_to_ns(stamp);
+    ),
+    TP_printk("%s state=%#x txb%u id=%#x stamp=%lld", __entry->name,
+          __entry->state, __entry->txb, __entry->can_id, __entry->stamp)
+);
+
+#endif /* _MCP2515_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mcp2515_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,362 @@
+/* rxbench.c: receive benchmark of the mcp2515 driver over its emulator
+ *
+ * Copyright 2010 Andre B. Oliveira
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/* The remote node of the emulated chip (see mcp2515_emu.c) sends frames
+ * at a rate, for a time, while the frames are received on a raw CAN
+ * socket.  Each run reports the rate sent and received, the frames lost
+ * in receive buffer overflows, the CPU time per frame received, and the
+ * latency from the interrupt that read a frame, its timestamp, to its
+ * reception on the socket.
+ *
+ * Without a rate, the rate is searched between a low and a high one for
+ * the highest without overflows.  Run by rxbench.sh.*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define EMU     "/sys/devices/platform/mcp2515-emu/"
+#define PARAMS  "/sys/module/mcp2515_emu/parameters/"
+
+/* Result of a run */
+struct run {
+    unsigned rate;          /* rate asked */
+    double sent;            /* frames per second sent */
+    double received;        /* frames per second received */
+    unsigned long long overflows;   /* frames lost in the chip */
+    unsigned long long over_errors; /* rx_over_errors of the driver */
+    double cpu;             /* CPU load, in % of one CPU */
+    double ns_per_frame;    /* CPU time per frame received */
+    double lat[4];          /* latency percentiles, in us */
+};
+
+/* Latency percentiles reported */
+static const double percentiles[4] = { 50, 99, 99.9, 100 };
+
+static const char *ifname = "can0";
+static unsigned chip;
+static double seconds = 2;
+static unsigned low = 500, high = 20000, precision = 100;
+
+static int sock;
+static long long *lats;
+static size_t nlats, maxlats;
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void write_file(const char *path, const char *value)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f || fputs(value, f) == EOF || fclose(f) == EOF)
+        die(path);
+}
+
+static unsigned long long read_ull(const char *path)
+{
+    unsigned long long value = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f || fscanf(f, "%llu", &value) != 1)
+        die(path);
+    fclose(f);
+
+    return value;
+}
+
+/* Read the counters rx_sent and rx_overflows of the chip.*/
+static void read_emu_stats(unsigned long long *sent,
+               unsigned long long *overflows)
+{
+    unsigned long long v[7];
+    char line[512];
+    unsigned n;
+    FILE *f = fopen(EMU "stats", "r");
+
+    if (!f)
+        die(EMU "stats");
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "chip%u spi_messages %llu spi_bytes %llu "
+               "interrupts %llu rx_sent %llu rx_frames %llu "
+               "rx_overflows %llu tx_frames %llu", &n, &v[0], &v[1],
+               &v[2], &v[3], &v[4], &v[5], &v[6]) == 8 && n == chip) {
+            *sent = v[3];
+            *overflows = v[5];
+            fclose(f);
+            return;
+        }
+    }
+    fprintf(stderr, "no chip%u in " EMU "stats\n", chip);
+    exit(1);
+}
+
+/* Return the busy time of all CPUs, in clock ticks.*/
+static unsigned long long cpu_busy(void)
+{
+    unsigned long long user, nice, system, idle, iowait, irq, softirq;
+    FILE *f = fopen("/proc/stat", "r");
+
+    if (!f || fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user,
+             &nice, &system, &idle, &iowait, &irq, &softirq) != 7)
+        die("/proc/stat");
+    fclose(f);
+
+    return user + nice + system + irq + softirq;
+}
+
+static double now(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Receive a frame, adding its latency, or return 0 if none is waiting.*/
+static int receive(void)
+{
+    struct can_frame frame;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { &frame, sizeof(frame) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    struct timespec stamp, ts;
+
+    if (recvmsg(sock, &msg, MSG_DONTWAIT) < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        die("recvmsg");
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+        if (nlats == maxlats) {
+            maxlats = maxlats ? 2 * maxlats : 65536;
+            lats = realloc(lats, maxlats * sizeof(*lats));
+            if (!lats)
+                die("realloc");
+        }
+        lats[nlats++] = (ts.tv_sec - stamp.tv_sec) * 1000000000LL +
+            ts.tv_nsec - stamp.tv_nsec;
+    }
+
+    return 1;
+}
+
+static void drain(void)
+{
+    while (receive())
+        ;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Run the remote node at RATE frames per second.*/
+static void run(unsigned rate, struct run *r)
+{
+    char path[128], value[32];
+    unsigned long long busy, sent, overflows, over_errors;
+    size_t frames = 0;
+    double start, end, t;
+    unsigned i;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/"
+         "rx_over_errors", ifname);
+
+    write_file(PARAMS "rx_fps", "0");
+    usleep(100000);
+    drain();
+    nlats = 0;
+    write_file(EMU "stats", "0");
+    over_errors = read_ull(path);
+    busy = cpu_busy();
+
+    snprintf(value, sizeof(value), "%u", rate);
+    write_file(PARAMS "rx_fps", value);
+    start = now(CLOCK_MONOTONIC);
+    end = start + seconds;
+    while ((t = now(CLOCK_MONOTONIC)) < end) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+
+        if (poll(&pfd, 1, (int)((end - t) * 1000) + 1) < 0 &&
+            errno != EINTR)
+            die("poll");
+        while (receive())
+            frames++;
+    }
+    write_file(PARAMS "rx_fps", "0");
+    t = now(CLOCK_MONOTONIC) - start;
+
+    busy = cpu_busy() - busy;
+    read_emu_stats(&sent, &overflows);
+    /* A remote node that does not follow the rate makes the run
+     * meaningless: better stop than report no overflows. */
+    if (!sent) {
+        fprintf(stderr, "the remote node sent no frames at %u frames/s\n",
+            rate);
+        exit(1);
+    }
+
+    r->rate = rate;
+    r->sent = sent / t;
+    r->received = frames / t;
+    r->overflows = overflows;
+    r->over_errors = read_ull(path) - over_errors;
+    r->cpu = 100.0 * busy / sysconf(_SC_CLK_TCK) / t;
+    r->ns_per_frame = frames ? 1e9 * busy / sysconf(_SC_CLK_TCK) / frames
+        : 0;
+
+    qsort(lats, nlats, sizeof(*lats), compare);
+    for (i = 0; i < 4; i++) {
+        size_t k = nlats * percentiles[i] / 100;
+
+        r->lat[i] = nlats ? lats[k < nlats ? k : nlats - 1] / 1e3 : 0;
+    }
+}
+
+static void print_header(void)
+{
+    printf("%8s %8s %8s %9s %9s %6s %8s %8s %8s %8s %8s\n", "rate",
+           "sent/s", "recv/s", "overflow", "over_err", "cpu%", "ns/frame",
+           "p50us", "p99us", "p99.9us", "maxus");
+}
+
+static void print_run(const struct run *r)
+{
+    printf("%8u %8.0f %8.0f %9llu %9llu %6.1f %8.0f %8.1f %8.1f %8.1f "
+           "%8.1f\n", r->rate, r->sent, r->received, r->overflows,
+           r->over_errors, r->cpu, r->ns_per_frame, r->lat[0], r->lat[1],
+           r->lat[2], r->lat[3]);
+    fflush(stdout);
+}
+
+static int overflowed(const struct run *r)
+{
+    return r->overflows || r->over_errors;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-i interface] [-c chip] [-t seconds] "
+        "[-r rate | -l low -h high -p precision]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_can addr = { .can_family = AF_CAN };
+    struct run r, best;
+    unsigned rate = 0, lo, hi, mid;
+    int one = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:c:t:r:l:h:p:")) != -1) {
+        switch (opt) {
+        case 'i': ifname = optarg; break;
+        case 'c': chip = atoi(optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'l': low = atoi(optarg); break;
+        case 'h': high = atoi(optarg); break;
+        case 'p': precision = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (seconds <= 0 || !low || low >= high || !precision)
+        usage(argv[0]);
+
+    sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (sock < 0)
+        die("socket");
+    addr.can_ifindex = if_nametoindex(ifname);
+    if (!addr.can_ifindex)
+        die(ifname);
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) ||
+        bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        die("socket");
+
+    print_header();
+
+    if (rate) {
+        run(rate, &r);
+        print_run(&r);
+        return overflowed(&r);
+    }
+
+    /* Search for the highest rate without overflows. */
+    run(high, &r);
+    print_run(&r);
+    if (!overflowed(&r)) {
+        printf("no overflow up to %u frames/s (%.0f sent)\n", high,
+               r.sent);
+        return 0;
+    }
+    run(low, &best);
+    print_run(&best);
+    if (overflowed(&best)) {
+        printf("overflow at %u frames/s already\n", low);
+        return 1;
+    }
+    lo = low;
+    hi = high;
+    while (hi - lo > precision) {
+        mid = lo + (hi - lo) / 2;
+        run(mid, &r);
+        print_run(&r);
+        if (overflowed(&r)) {
+            hi = mid;
+        } else {
+            lo = mid;
+            best = r;
+        }
+    }
+
+    printf("max rate without overflow: %u frames/s (%.0f sent)\n", lo,
+           best.sent);
+    print_header();
+    print_run(&best);
+
+    return 0;
+}
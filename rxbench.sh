@@ -0,0 +1,41 @@
+#!/bin/sh
+# Load the driver over its emulator, bring the interface up and run
+# rxbench with the arguments given, then unload them.
+#
+# BITRATE: bit rate of the bus (default 1000000)
+# EMU_ARGS: parameters of mcp2515_emu, e.g. "spi_hz=4000000 rx_dlcs=0,8,8"
+# REPLAY: candump log to replay instead of generated frames
+
+BITRATE=${BITRATE:-1000000}
+EMU=/sys/devices/platform/mcp2515-emu
+
+cd "$(dirname "$0")" || exit 1
+
+cleanup() {
+    [ -n "$IF" ] && ip link set "$IF" down
+    rmmod mcp2515_emu
+    rmmod mcp2515
+}
+
+insmod ./mcp2515.ko || exit 1
+insmod ./mcp2515_emu.ko $EMU_ARGS || { rmmod mcp2515; exit 1; }
+trap cleanup EXIT
+
+IF=$(basename "$(find $EMU/ -maxdepth 5 -path '*/net/*' -name 'can*' | head -n 1)")
+if [ -z "$IF" ] || [ "$IF" = . ]; then
+    echo "no CAN interface on the emulator" >&2
+    IF=
+    exit 1
+fi
+
+# The replay file takes a page per write, so write it a line at a time.
+if [ -n "$REPLAY" ]; then
+    while IFS= read -r line; do
+        echo "$line" > $EMU/replay || exit 1
+    done < "$REPLAY"
+    echo "replaying $(cat $EMU/replay) frames of $REPLAY"
+fi
+
+ip link set "$IF" up type can bitrate "$BITRATE" || exit 1
+echo "$IF at $BITRATE bit/s: $EMU_ARGS"
+./rxbench -i "$IF" "$@"